@@ -0,0 +1,207 @@
+#include "util.h"
+#include "control.h"
+#include "capture.h"
+
+#include <time.h>
+
+#include <rte_lcore.h>
+#include <rte_cycles.h>
+#include <rte_ring.h>
+
+#define NS_PER_SEC 1000000000ULL
+
+static struct cap_ctl cap_ctl = {
+	.is_enabled = false,
+	.file = {'\0'},
+	.snaplen = CAP_SNAPLEN_DEF,
+	.nb_queue = 0,
+	.base_ns = 0,
+	.base_tsc = 0,
+	.ns_per_cycle = 0,
+	.nb_pkt = 0,
+	.nb_byte = 0,
+};
+
+void cap_set_output(const char *filename)
+{
+	if (strlen(filename) == 0) {
+		snprintf(cap_ctl.file, FILEPATH_MAX, "rx.pcap");
+	}
+	else {
+		snprintf(cap_ctl.file, FILEPATH_MAX, "%s", filename);
+	}
+	cap_ctl.is_enabled = true;
+}
+
+bool cap_set_snaplen(const char *arg)
+{
+	int val = 0;
+
+	if (!str_to_int(arg, 10, &val) || val <= 0 || val > CAP_SNAPLEN_DEF) {
+		LOG_ERROR("Snaplen should be in [1, %u]", CAP_SNAPLEN_DEF);
+		return false;
+	}
+	cap_ctl.snaplen = val;
+	return true;
+}
+
+bool cap_is_enabled(void)
+{
+	return cap_ctl.is_enabled;
+}
+
+struct cap_queue *cap_get_queue(unsigned queue)
+{
+	if (!cap_ctl.is_enabled || queue >= cap_ctl.nb_queue)
+		return NULL;
+	return &cap_ctl.queue[queue];
+}
+
+static void __free_rings(void)
+{
+	unsigned i = 0;
+
+	for (i = 0; i < cap_ctl.nb_queue; i++) {
+		rte_ring_free(cap_ctl.queue[i].ring);
+		cap_ctl.queue[i].ring = NULL;
+	}
+}
+
+/* Pair the wall clock with the TSC, the packet times are derived from
+ * their TSC timestamps */
+static void __init_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	cap_ctl.base_tsc = rte_get_tsc_cycles();
+	cap_ctl.base_ns = (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+	cap_ctl.ns_per_cycle = (double)NS_PER_SEC / rte_get_tsc_hz();
+}
+
+bool cap_init(unsigned nb_rx_queue)
+{
+	struct pcap_file_hdr hdr = {
+		.magic = PCAP_MAGIC_NS,
+		.version_major = PCAP_VERSION_MAJOR,
+		.version_minor = PCAP_VERSION_MINOR,
+		.thiszone = 0,
+		.sigfigs = 0,
+		.snaplen = cap_ctl.snaplen,
+		.linktype = PCAP_LINK_EN10MB,
+	};
+	char name[RTE_RING_NAMESIZE];
+	unsigned i = 0;
+
+	if (!cap_ctl.is_enabled)
+		return true;
+
+	cap_ctl.nb_queue = nb_rx_queue;
+	for (i = 0; i < nb_rx_queue; i++) {
+		snprintf(name, RTE_RING_NAMESIZE, "cap_ring_%u", i);
+		cap_ctl.queue[i].ring = rte_ring_create(name, CAP_RING_SIZE,
+						rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
+		if (!cap_ctl.queue[i].ring) {
+			LOG_ERROR("Failed to create capture ring %u", i);
+			goto free_rings;
+		}
+		cap_ctl.queue[i].nb_drop = 0;
+	}
+
+	if (!writer_open(&cap_ctl.writer, cap_ctl.file)) {
+		LOG_ERROR("Failed to open output pcap file %s", cap_ctl.file);
+		goto free_rings;
+	}
+	writer_write(&cap_ctl.writer, &hdr, sizeof(hdr));
+
+	__init_clock();
+	LOG_INFO("All packets will be written to pcap file %s, snaplen %u",
+					cap_ctl.file, cap_ctl.snaplen);
+	return true;
+
+free_rings:
+	__free_rings();
+	return false;
+}
+
+static void __write_pkt(struct cap_ctl *ctl, struct rte_mbuf *pkt)
+{
+	struct pcap_rec_hdr rec;
+	struct rte_mbuf *seg = NULL;
+	uint64_t ns = 0;
+	uint32_t left = 0, n = 0;
+
+	ns = ctl->base_ns + (int64_t)((double)(int64_t)(pkt->timestamp
+					- ctl->base_tsc) * ctl->ns_per_cycle);
+	rec.ts_sec = ns / NS_PER_SEC;
+	rec.ts_frac = ns % NS_PER_SEC;
+	rec.caplen = RTE_MIN(pkt->pkt_len, ctl->snaplen);
+	rec.len = pkt->pkt_len;
+	writer_write(&ctl->writer, &rec, sizeof(rec));
+
+	left = rec.caplen;
+	for (seg = pkt; seg && left > 0; seg = seg->next) {
+		n = RTE_MIN(seg->data_len, left);
+		writer_write(&ctl->writer, rte_pktmbuf_mtod(seg, void *), n);
+		left -= n;
+	}
+
+	ctl->nb_pkt++;
+	ctl->nb_byte += rec.caplen;
+	rte_pktmbuf_free(pkt);
+}
+
+static unsigned __drain_queue(struct cap_ctl *ctl, struct cap_queue *q)
+{
+	struct rte_mbuf *pkts[CAP_BURST];
+	unsigned nb = 0, i = 0;
+
+	nb = rte_ring_sc_dequeue_burst(q->ring, (void **)pkts, CAP_BURST, NULL);
+	for (i = 0; i < nb; i++)
+		__write_pkt(ctl, pkts[i]);
+	return nb;
+}
+
+/* The RX workers don't enqueue anymore once they are stopped */
+static bool __is_rx_done(void)
+{
+	return ctl_is_stop(WORKER_RX)
+			&& ctl_get_state(WORKER_RX) != STATE_INITED;
+}
+
+void cap_thread_run(void)
+{
+	struct cap_ctl *ctl = &cap_ctl;
+	uint64_t nb_drop = 0;
+	unsigned i = 0, nb = 0;
+	bool is_done = false;
+
+	LOG_INFO("capture running on lcore %u", rte_lcore_id());
+	ctl_set_state(WORKER_CAP, 0, STATE_INITED);
+
+	while (1) {
+		/* checked before the last drain, so that nothing is left */
+		is_done = __is_rx_done();
+
+		nb = 0;
+		for (i = 0; i < ctl->nb_queue; i++)
+			nb += __drain_queue(ctl, &ctl->queue[i]);
+
+		if (nb == 0) {
+			if (is_done)
+				break;
+			writer_poll(&ctl->writer);
+		}
+	}
+
+	writer_close(&ctl->writer);
+
+	for (i = 0; i < ctl->nb_queue; i++)
+		nb_drop += ctl->queue[i].nb_drop;
+	LOG_INFO("Captured %lu packets (%lu bytes), %lu dropped from the capture",
+					ctl->nb_pkt, ctl->nb_byte, nb_drop);
+
+	__free_rings();
+	LOG_INFO("Capture thread quit");
+	ctl_set_state(WORKER_CAP, 0, STATE_STOPPED);
+}
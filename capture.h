@@ -0,0 +1,76 @@
+#ifndef _PKTGEN_CAPTURE_H_
+#define _PKTGEN_CAPTURE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <rte_ring.h>
+#include <rte_mbuf.h>
+
+#include "util.h"
+#include "control.h"
+#include "writer.h"
+#include "pcap_file.h"
+
+/* The RX workers hand the received mbufs over to the capture lcore
+ * through one ring per RX queue, with their RX time (TSC) in
+ * mbuf->timestamp. The capture lcore writes them to a pcap file with
+ * nanosecond timestamps, through the batching writer. When a ring is
+ * full, the packets are dropped from the capture only. */
+#define CAP_RING_SIZE 4096
+#define CAP_BURST 64
+#define CAP_SNAPLEN_DEF 65535
+
+/* Enqueued by one RX queue, dequeued by the capture lcore */
+struct cap_queue {
+	struct rte_ring *ring;
+	/* packets the ring had no room for */
+	uint64_t nb_drop;
+} __rte_cache_aligned;
+
+struct cap_ctl {
+	bool is_enabled;
+	char file[FILEPATH_MAX];
+	uint32_t snaplen;
+
+	unsigned nb_queue;
+	struct cap_queue queue[WORKER_QUEUE_MAX];
+
+	/* TSC to wall clock: ns = base_ns + (tsc - base_tsc) * ns_per_cycle */
+	uint64_t base_ns;
+	uint64_t base_tsc;
+	double ns_per_cycle;
+
+	struct writer writer;
+	uint64_t nb_pkt;
+	uint64_t nb_byte;
+};
+
+void cap_set_output(const char *filename);
+
+bool cap_set_snaplen(const char *arg);
+
+bool cap_is_enabled(void);
+
+bool cap_init(unsigned nb_rx_queue);
+
+struct cap_queue *cap_get_queue(unsigned queue);
+
+/* Hand pkts over to the capture lcore, the ones that don't fit in the
+ * ring are freed */
+static inline void cap_enqueue(struct cap_queue *q,
+				struct rte_mbuf **pkts, unsigned nb)
+{
+	unsigned n = 0;
+
+	n = rte_ring_sp_enqueue_burst(q->ring, (void * const *)pkts, nb, NULL);
+	if (unlikely(n < nb)) {
+		q->nb_drop += nb - n;
+		for (; n < nb; n++)
+			rte_pktmbuf_free(pkts[n]);
+	}
+}
+
+void cap_thread_run(void);
+
+#endif /* _PKTGEN_CAPTURE_H_ */
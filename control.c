@@ -9,7 +9,7 @@ static bool force_quit = false;
 static uint64_t rx_quit_cycle = 0;
 
 static struct ctl_worker worker_state[WORKER_MAX] = {
-	{ .state = STATE_UNINIT, .lcoreid = UINT_MAX }
+	{ .nb_queue = 0 }
 };
 
 bool ctl_is_stop(unsigned workerid)
@@ -44,35 +44,71 @@ void ctl_signal_handler(int signo)
 	}
 }
 
+/* The state of a worker type is the least advanced state among its
+ * queues, i.e. UNINIT until all queues are initialized, and STOPPED
+ * (or ERROR) only when none of them is still running. */
 unsigned int ctl_get_state(unsigned worker)
 {
+	struct ctl_worker *w = NULL;
+	unsigned i = 0, state = STATE_STOPPED;
+
 	if (worker >= WORKER_MAX)
 		return STATE_UNINIT;
 
-	return worker_state[worker].state;
+	w = &worker_state[worker];
+	if (w->nb_queue == 0)
+		return STATE_UNINIT;
+
+	for (i = 0; i < w->nb_queue; i++) {
+		if (w->state[i] == STATE_UNINIT)
+			return STATE_UNINIT;
+		if (w->state[i] == STATE_INITED)
+			state = STATE_INITED;
+		else if (w->state[i] == STATE_ERROR && state == STATE_STOPPED)
+			state = STATE_ERROR;
+	}
+	return state;
 }
 
-void ctl_set_state(unsigned worker, unsigned state)
+void ctl_set_state(unsigned worker, unsigned queue, unsigned state)
 {
-	if (worker >= WORKER_MAX)
+	if (worker >= WORKER_MAX || queue >= WORKER_QUEUE_MAX)
 		return;
-	worker_state[worker].state = state;
+	worker_state[worker].state[queue] = state;
 }
 
-void ctl_set_lcore(unsigned worker, unsigned core)
+void ctl_set_lcore(unsigned worker, unsigned queue, unsigned core)
 {
-	if (worker >= WORKER_MAX)
+	struct ctl_worker *w = NULL;
+
+	if (worker >= WORKER_MAX || queue >= WORKER_QUEUE_MAX)
 		return;
-	worker_state[worker].lcoreid = core;
+
+	w = &worker_state[worker];
+	w->lcoreid[queue] = core;
+	w->state[queue] = STATE_UNINIT;
+	if (queue >= w->nb_queue)
+		w->nb_queue = queue + 1;
 }
 
-unsigned ctl_get_workerid(unsigned lcoreid)
+unsigned ctl_get_nb_queue(unsigned worker)
 {
-	unsigned i = 0;
+	if (worker >= WORKER_MAX)
+		return 0;
+	return worker_state[worker].nb_queue;
+}
+
+unsigned ctl_get_workerid(unsigned lcoreid, unsigned *queue)
+{
+	unsigned i = 0, q = 0;
 
 	for (i = 0; i < WORKER_MAX; i++) {
-		if (worker_state[i].lcoreid == lcoreid)
-			return i;
+		for (q = 0; q < worker_state[i].nb_queue; q++) {
+			if (worker_state[i].lcoreid[q] == lcoreid) {
+				*queue = q;
+				return i;
+			}
+		}
 	}
 	return WORKER_MAX;
 }
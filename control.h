@@ -12,12 +12,17 @@ enum {
 	WORKER_STAT = 0,
 	WORKER_RX = 1,
 	WORKER_TX = 2,
-	WORKER_MAX = 3
+	WORKER_CAP = 3,
+	WORKER_MAX = 4
 };
 
+/* Max number of lcores (queues) of one worker type */
+#define WORKER_QUEUE_MAX 16
+
 struct ctl_worker {
-	unsigned state;
-	unsigned lcoreid;
+	unsigned nb_queue;
+	unsigned state[WORKER_QUEUE_MAX];
+	unsigned lcoreid[WORKER_QUEUE_MAX];
 };
 
 // ms
@@ -31,10 +36,12 @@ void ctl_signal_handler(int signo);
 
 unsigned ctl_get_state(unsigned worker);
 
-void ctl_set_state(unsigned worker, unsigned state);
+void ctl_set_state(unsigned worker, unsigned queue, unsigned state);
+
+void ctl_set_lcore(unsigned worker, unsigned queue, unsigned core);
 
-void ctl_set_lcore(unsigned worker, unsigned core);
+unsigned ctl_get_nb_queue(unsigned worker);
 
-unsigned ctl_get_workerid(unsigned lcoreid);
+unsigned ctl_get_workerid(unsigned lcoreid, unsigned *queue);
 
 #endif /* _PKTGEN_CONTROL_H_ */
@@ -0,0 +1,59 @@
+#include "util.h"
+#include "hist.h"
+
+void hist_reset(struct hist *hist)
+{
+	memset(hist, 0, sizeof(struct hist));
+	hist->min = UINT64_MAX;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+	unsigned i = 0;
+
+	if (src->nb == 0)
+		return;
+
+	for (i = 0; i < HIST_NB_BUCKET; i++)
+		dst->count[i] += src->count[i];
+	dst->nb += src->nb;
+	dst->sum += src->sum;
+	dst->min = RTE_MIN(dst->min, src->min);
+	dst->max = RTE_MAX(dst->max, src->max);
+}
+
+/* Middle of the values of bucket idx */
+static uint64_t __bucket_value(unsigned idx)
+{
+	unsigned shift = 0;
+
+	if (idx < (HIST_SUB_HALF << 1))
+		return idx;
+	shift = (idx >> (HIST_SUB_BITS - 1)) - 1;
+	return ((idx & (HIST_SUB_HALF - 1)) + HIST_SUB_HALF) << shift
+				| ((1ULL << shift) - 1) >> 1;
+}
+
+/* Value at quantile q (0 to 1), within the bucket precision. The
+ * extremes are the exact min and max. */
+uint64_t hist_percentile(const struct hist *hist, double q)
+{
+	uint64_t rank = 0, cnt = 0;
+	unsigned i = 0;
+
+	if (hist->nb == 0)
+		return 0;
+
+	rank = (uint64_t)(q * hist->nb + 0.999999);
+	if (rank == 0)
+		return hist->min;
+	if (rank >= hist->nb)
+		return hist->max;
+
+	for (i = 0; i < HIST_NB_BUCKET; i++) {
+		cnt += hist->count[i];
+		if (cnt >= rank)
+			return RTE_MAX(RTE_MIN(__bucket_value(i), hist->max), hist->min);
+	}
+	return hist->max;
+}
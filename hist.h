@@ -0,0 +1,53 @@
+#ifndef _PKTGEN_HIST_H_
+#define _PKTGEN_HIST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <rte_common.h>
+
+/* Log-linear (HDR-style) histogram of 64-bit values. Values below
+ * 2^HIST_SUB_BITS get a bucket each, above that every power of two is
+ * split into 2^(HIST_SUB_BITS - 1) buckets, which bounds the relative
+ * error of a bucket to 2^-(HIST_SUB_BITS - 1). */
+#define HIST_SUB_BITS 8
+#define HIST_SUB_HALF (1ULL << (HIST_SUB_BITS - 1))
+#define HIST_NB_BUCKET ((64 - HIST_SUB_BITS + 2) * HIST_SUB_HALF)
+
+/* Written by a single thread, read when that thread is done */
+struct hist {
+	uint64_t nb;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t count[HIST_NB_BUCKET];
+} __rte_cache_aligned;
+
+static inline unsigned hist_bucket(uint64_t val)
+{
+	unsigned shift = 0;
+
+	if (val < (HIST_SUB_HALF << 1))
+		return val;
+	shift = 63 - __builtin_clzll(val) - HIST_SUB_BITS + 1;
+	return (shift << (HIST_SUB_BITS - 1)) + (val >> shift);
+}
+
+static inline void hist_add(struct hist *hist, uint64_t val)
+{
+	hist->count[hist_bucket(val)]++;
+	hist->nb++;
+	hist->sum += val;
+	if (val < hist->min)
+		hist->min = val;
+	if (val > hist->max)
+		hist->max = val;
+}
+
+void hist_reset(struct hist *hist);
+
+void hist_merge(struct hist *dst, const struct hist *src);
+
+uint64_t hist_percentile(const struct hist *hist, double q);
+
+#endif /* _PKTGEN_HIST_H_ */
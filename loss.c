@@ -0,0 +1,93 @@
+#include "util.h"
+#include "loss.h"
+
+/* Streams start at sequence 0. The slots before it are marked as
+ * received, so that they don't count as lost when they leave. */
+void loss_reset(struct loss_track *loss)
+{
+	memset(loss, 0, sizeof(struct loss_track));
+	memset(loss->bitmap, 0xff, sizeof(loss->bitmap));
+}
+
+/* Move the head to head, the missing packets leaving the window are
+ * lost and the slots entering it are cleared */
+static void __loss_advance(struct loss_track *loss, uint64_t head)
+{
+	uint64_t seq = loss->head, end = head;
+	uint64_t *word = NULL, bit = 0;
+
+	if (head - loss->head > LOSS_WINDOW) {
+		/* the packets jumped over never got into the window */
+		loss->nb_lost += head - loss->head - LOSS_WINDOW;
+		end = loss->head + LOSS_WINDOW;
+	}
+
+	while (seq < end) {
+		word = &loss->bitmap[(seq % LOSS_WINDOW) / 64];
+		if (seq % 64 == 0 && end - seq >= 64) {
+			loss->nb_lost += 64 - __builtin_popcountll(*word);
+			*word = 0;
+			seq += 64;
+			continue;
+		}
+		bit = 1ULL << (seq % 64);
+		if (!(*word & bit))
+			loss->nb_lost++;
+		*word &= ~bit;
+		seq++;
+	}
+	loss->head = head;
+}
+
+void __loss_add_slow(struct loss_track *loss, uint64_t seq)
+{
+	uint64_t *word = &loss->bitmap[(seq % LOSS_WINDOW) / 64];
+	uint64_t bit = 1ULL << (seq % 64), dist = 0;
+
+	if (seq > loss->head) {
+		__loss_advance(loss, seq + 1);
+		*word |= bit;
+		return;
+	}
+
+	if (loss->head - seq > LOSS_WINDOW) {
+		loss->nb_late++;
+		return;
+	}
+
+	if (*word & bit) {
+		loss->nb_dup++;
+		return;
+	}
+
+	dist = loss->head - 1 - seq;
+	loss->nb_reorder++;
+	loss->sum_reorder += dist;
+	if (dist > loss->max_reorder)
+		loss->max_reorder = dist;
+	*word |= bit;
+}
+
+/* At the end of a stream, what is still missing in the window is lost */
+void loss_flush(struct loss_track *loss)
+{
+	unsigned i = 0;
+
+	for (i = 0; i < LOSS_WINDOW_WORDS; i++) {
+		loss->nb_lost += 64 - __builtin_popcountll(loss->bitmap[i]);
+		loss->bitmap[i] = ~0ULL;
+	}
+}
+
+/* Sum up the counters of src into dst */
+void loss_merge(struct loss_track *dst, const struct loss_track *src)
+{
+	dst->nb_recv += src->nb_recv;
+	dst->nb_lost += src->nb_lost;
+	dst->nb_reorder += src->nb_reorder;
+	dst->nb_dup += src->nb_dup;
+	dst->nb_late += src->nb_late;
+	dst->sum_reorder += src->sum_reorder;
+	if (src->max_reorder > dst->max_reorder)
+		dst->max_reorder = src->max_reorder;
+}
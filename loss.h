@@ -0,0 +1,59 @@
+#ifndef _PKTGEN_LOSS_H_
+#define _PKTGEN_LOSS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <rte_branch_prediction.h>
+
+/* Sliding window over the sequence numbers of one stream. A packet
+ * missing when it leaves the window is lost, one arriving behind the
+ * highest sequence is reordered (by the distance to it) if still in
+ * the window, late otherwise. Late packets were already counted lost,
+ * they may also be duplicates of old packets. */
+#define LOSS_WINDOW 4096
+#define LOSS_WINDOW_WORDS (LOSS_WINDOW / 64)
+
+/* Written by a single thread, the counters may be read by others */
+struct loss_track {
+	/* highest sequence received + 1 */
+	uint64_t head;
+	uint64_t nb_recv;
+	uint64_t nb_lost;
+	uint64_t nb_reorder;
+	uint64_t nb_dup;
+	uint64_t nb_late;
+	uint64_t max_reorder;
+	uint64_t sum_reorder;
+	/* bit (seq % LOSS_WINDOW) is set when seq is received */
+	uint64_t bitmap[LOSS_WINDOW_WORDS];
+};
+
+void loss_reset(struct loss_track *loss);
+
+void __loss_add_slow(struct loss_track *loss, uint64_t seq);
+
+static inline void loss_add(struct loss_track *loss, uint64_t seq)
+{
+	uint64_t *word = NULL, bit = 0;
+
+	loss->nb_recv++;
+	if (unlikely(seq != loss->head)) {
+		__loss_add_slow(loss, seq);
+		return;
+	}
+
+	/* in order: the slot of seq - LOSS_WINDOW leaves the window */
+	word = &loss->bitmap[(seq % LOSS_WINDOW) / 64];
+	bit = 1ULL << (seq % 64);
+	if (!(*word & bit))
+		loss->nb_lost++;
+	*word |= bit;
+	loss->head++;
+}
+
+void loss_flush(struct loss_track *loss);
+
+void loss_merge(struct loss_track *dst, const struct loss_track *src);
+
+#endif /* _PKTGEN_LOSS_H_ */
@@ -5,6 +5,7 @@
 #include <rte_mempool.h>
 #include <rte_ethdev.h>
 #include <rte_eth_ring.h>
+#include <rte_cycles.h>
 
 #include <getopt.h>
 #include <signal.h>
@@ -14,9 +15,11 @@
 #include "util.h"
 #include "stat.h"
 #include "rx.h"
+#include "capture.h"
 #include "tx.h"
 #include "control.h"
 #include "pkt_seq.h"
+#include "trial.h"
 
 #define RX_RING_SIZE 1024
 #define TX_RING_SIZE 1024
@@ -24,9 +27,18 @@
 #define NUM_MBUFS 8191
 #define MBUF_CACHE_SIZE 250
 #define BURST_SIZE 32
+/* Time for a started port to bring its link up */
+#define LINK_WAIT_MS 9000
+#define LINK_POLL_MS 100
 
 static unsigned tx_type = TX_TYPE_SINGLE;
 
+static unsigned nb_tx_queue = 1;
+static unsigned nb_rx_queue = 1;
+
+static bool is_split = false;
+static bool is_hw_rx_ts = false;
+
 static struct rte_mempool *mbuf_pool = NULL;
 
 static char *trace_file = NULL;
@@ -40,24 +52,61 @@ static const struct rte_eth_conf port_conf_default = {
 static void __usage(const char *progname)
 {
 	LOG_INFO("Usage: %s [<EAL args>] -- ", progname);
-	LOG_INFO("\t\t-r <TX rate (default 0)>");
+	LOG_INFO("\t\t-r <TX rate, <n>[k|m|g][bps|pps] or <n>%% of line rate "
+				"(default 1mbps)>");
+	LOG_INFO("\t\t-f <load profile, ramp:<from>:<to>:<sec>, "
+				"step:<from>:<to>:<inc>:<sec> or sine:<min>:<max>:<period>>");
+	LOG_INFO("\t\t-e Exponential gaps between bursts (Poisson arrivals "
+				"with -b 1)");
+	LOG_INFO("\t\t-B <frame sizes, e.g. 64,512,1518: RFC 2544 search of the "
+				"highest rate up to -r without loss>");
+	LOG_INFO("\t\t-W <from>:<to>:<steps>[:<frame size>]: latency vs load "
+				"sweep up to the knee, needs -l, not with -r>");
+	LOG_INFO("\t\t-L <loss tolerance of the search or sweep in %% "
+				"(default 0)>");
 	LOG_INFO("\t\t-t <5-tuple trace file>");
-	LOG_INFO("\t\t-o <output pcap file>");
-	LOG_INFO("\t\t-l <latency file prefix>");
+	LOG_INFO("\t\t-p <pcap file>[:<loops>[:<speed>]]: replay a capture "
+				"loops times (default 1, 0 until stopped), at the capture "
+				"timing scaled by speed, else at -r");
+	LOG_INFO("\t\t-o <output pcap file>: capture on an extra lcore, "
+				"nanosecond timestamps");
+	LOG_INFO("\t\t-N <snaplen of the capture (default %u)>",
+				CAP_SNAPLEN_DEF);
+	LOG_INFO("\t\t-l <latency file prefix>: raw latency records and "
+				"histogram");
+	LOG_INFO("\t\t-g Latency histogram only, no raw record");
+	LOG_INFO("\t\t-a <latency sampling, one packet in <n> or one every "
+				"<t>us per TX queue (default all packets)>");
+	LOG_INFO("\t\t-z Delta/varint encoded latency records "
+				"(decoded by parse_raw_record.py)");
+	LOG_INFO("\t\t-F <MB of the latency record file to preallocate>");
+	LOG_INFO("\t\t-K <latency pages per RX queue>[:<max pages>] "
+				"(default 128:4096)");
 	LOG_INFO("\t\t-R Random pakcets");
 	LOG_INFO("\t\t-b <TX burst size>");
 	LOG_INFO("\t\t-c <number of packets to send>");
+	LOG_INFO("\t\t-n <number of TX cores/queues (default 1)>");
+	LOG_INFO("\t\t-m <number of RX cores/queues (default 1, RSS if > 1, "
+				"then no loss/reordering count)>");
+	LOG_INFO("\t\t-P Build packets once in a dedicated TX pool");
+	LOG_INFO("\t\t-S Send packets as header + shared payload segments");
+	LOG_INFO("\t\t-T Take TX timestamps right before sending");
+	LOG_INFO("\t\t-H Use NIC RX timestamps for latency if supported");
+	LOG_INFO("\t\t-s Per-packet software RX timestamps for latency");
 }
 
 static int __parse_options(int argc, char *argv[])
 {
-	int opt = 0;
+	int opt = 0, val = 0;
 	char **argvopt = argv;
 	const char *progname = NULL;
-	bool is_trace = false, is_random = false;
+	bool is_trace = false, is_random = false, is_profile = false;
+	bool is_pcap = false;
+	bool is_sweep = false, is_record = false, is_rate = false;
+	bool is_compact = false, is_prealloc = false;
 
 	progname = argv[0];
-	while ((opt = getopt(argc, argvopt, "t:r:l:o:Rb:c:")) != -1) {
+	while ((opt = getopt(argc, argvopt, "t:p:r:f:eB:W:L:l:gza:F:K:o:N:Rb:c:n:m:PSTHs")) != -1) {
 		switch(opt) {
 			case 't':
 				trace_file = strdup(optarg);
@@ -70,8 +119,36 @@ static int __parse_options(int argc, char *argv[])
 				LOG_INFO("Use 5-tuple trace file %s", trace_file);
 				is_trace = true;
 				break;
+			case 'p':
+				if (!tx_set_pcap(optarg))
+					return -1;
+				is_pcap = true;
+				break;
 			case 'r':
-				tx_set_rate(optarg);
+				if (!tx_set_rate(optarg))
+					return -1;
+				is_rate = true;
+				break;
+			case 'f':
+				if (!rate_set_profile(optarg))
+					return -1;
+				is_profile = true;
+				break;
+			case 'e':
+				rate_enable_poisson();
+				break;
+			case 'B':
+				if (!trial_set_search(optarg))
+					return -1;
+				break;
+			case 'W':
+				if (!trial_set_sweep(optarg))
+					return -1;
+				is_sweep = true;
+				break;
+			case 'L':
+				if (!trial_set_loss_tolerance(optarg))
+					return -1;
 				break;
 			case 'l':
 				if (!stat_set_output(optarg)) {
@@ -79,27 +156,113 @@ static int __parse_options(int argc, char *argv[])
 					return -1;
 				}
 				rx_enable_latency();
+				is_record = true;
+				tx_enable_latency();
+				break;
+			case 'z':
+				stat_enable_compact();
+				is_compact = true;
+				break;
+			case 'a':
+				if (!tx_set_sampling(optarg))
+					return -1;
+				break;
+			case 'F':
+				if (!stat_set_prealloc(optarg))
+					return -1;
+				is_prealloc = true;
+				break;
+			case 'K':
+				if (!stat_set_page_pool(optarg))
+					return -1;
+				break;
+			case 'g':
+				stat_enable_latency();
+				rx_enable_latency();
 				tx_enable_latency();
 				break;
 			case 'o':
-				rx_set_pcap_output(optarg);
+				cap_set_output(optarg);
+				break;
+			case 'N':
+				if (!cap_set_snaplen(optarg))
+					return -1;
 				break;
 			case 'R':
 				is_random = true;
 				break;
+			case 'P':
+				tx_enable_prebuilt();
+				break;
+			case 'S':
+				tx_enable_split();
+				is_split = true;
+				break;
+			case 'T':
+				tx_enable_late_timestamp();
+				break;
+			case 'H':
+				is_hw_rx_ts = true;
+				break;
+			case 's':
+				rx_enable_sw_timestamp();
+				break;
 			case 'b':
 				tx_set_burst(atoi(optarg));
 				break;
 			case 'c':
 				tx_set_count(atoi(optarg));
 				break;
+			case 'n':
+				if (!str_to_int(optarg, 10, &val) || val <= 0
+								|| val > WORKER_QUEUE_MAX) {
+					LOG_ERROR("Number of TX queues should be in [1, %u]",
+									WORKER_QUEUE_MAX);
+					return -1;
+				}
+				nb_tx_queue = val;
+				break;
+			case 'm':
+				if (!str_to_int(optarg, 10, &val) || val <= 0
+								|| val > WORKER_QUEUE_MAX) {
+					LOG_ERROR("Number of RX queues should be in [1, %u]",
+									WORKER_QUEUE_MAX);
+					return -1;
+				}
+				nb_rx_queue = val;
+				break;
 			default:
 				__usage(progname);
 				return -1;
 		}
 	}
 
-	if (is_trace && is_random) {
+	if (is_profile && trial_is_enabled()) {
+		LOG_ERROR("Load profiles and trials can't be used together");
+		return -1;
+	}
+
+	if (is_sweep && is_rate) {
+		LOG_ERROR("Sweep sets its own rates, it can't be used with -r");
+		return -1;
+	}
+
+	if ((is_compact || is_prealloc) && !is_record) {
+		LOG_ERROR("-z and -F only apply to raw latency records (-l)");
+		return -1;
+	}
+
+	if (is_sweep && !is_record) {
+		LOG_ERROR("Sweep needs raw latency records (-l)");
+		return -1;
+	}
+
+	if (is_pcap) {
+		if (is_trace || is_random)
+			LOG_INFO("Pcap replay is selected, other traces are ignored");
+		tx_type = TX_TYPE_PCAP;
+	}
+	else if (is_trace && is_random) {
 		LOG_INFO("Both of 5tuple trace and random trace are selected, use 5-tuple trace");
 		tx_type = TX_TYPE_5TUPLE_TRACE;
 	}
@@ -118,33 +281,61 @@ static int __parse_options(int argc, char *argv[])
 /* return value: if need to create stats thread */
 static void __set_lcore(void)
 {
-	unsigned core = 0;
-	unsigned rx_core = UINT_MAX, tx_core = UINT_MAX, master_core = UINT_MAX;
+	unsigned core = 0, nb_tx = 0, nb_rx = 0;
+	unsigned master_core = UINT_MAX;
+	bool is_cap_set = !cap_is_enabled();
 
 	for (core = 0; core < RTE_MAX_LCORE; core++) {
 		if (rte_lcore_is_enabled(core) == 0)
 			continue;
 		if (master_core == UINT_MAX)
 			master_core = core;
-		else if (tx_core == UINT_MAX)
-			tx_core = core;
-		else if (rx_core == UINT_MAX)
-			rx_core = core;
+		else if (nb_tx < nb_tx_queue) {
+			ctl_set_lcore(WORKER_TX, nb_tx, core);
+			LOG_INFO("Lcore configuration: TX queue %u on %u", nb_tx, core);
+			nb_tx++;
+		}
+		else if (nb_rx < nb_rx_queue) {
+			ctl_set_lcore(WORKER_RX, nb_rx, core);
+			LOG_INFO("Lcore configuration: RX queue %u on %u", nb_rx, core);
+			nb_rx++;
+		}
+		else if (!is_cap_set) {
+			ctl_set_lcore(WORKER_CAP, 0, core);
+			LOG_INFO("Lcore configuration: capture on %u", core);
+			is_cap_set = true;
+		}
 		else
 			break;
 	}
-	ctl_set_lcore(WORKER_STAT, master_core);
-	ctl_set_lcore(WORKER_RX, rx_core);
-	ctl_set_lcore(WORKER_TX, tx_core);
-	LOG_INFO("Lcore configuration: Master %u, TX %u, RX %u",
-				master_core, tx_core, rx_core);
+	ctl_set_lcore(WORKER_STAT, 0, master_core);
+	LOG_INFO("Lcore configuration: Master %u", master_core);
+}
+
+/* Right after the port is started, the link may still be down and its
+ * speed 0 or not final */
+static void __wait_link_up(uint16_t port)
+{
+	struct rte_eth_link link;
+	unsigned ms = 0;
+
+	for (ms = 0; ms <= LINK_WAIT_MS; ms += LINK_POLL_MS) {
+		memset(&link, 0, sizeof(struct rte_eth_link));
+		if (rte_eth_link_get_nowait(port, &link) == 0
+						&& link.link_status == ETH_LINK_UP) {
+			LOG_INFO("Port %u link up, %u Mbps", port, link.link_speed);
+			return;
+		}
+		rte_delay_ms(LINK_POLL_MS);
+	}
+	LOG_ERROR("Port %u link is still down after %u ms", port, LINK_WAIT_MS);
 }
 
 static inline int
 __port_init(uint16_t port, struct rte_mempool *mbuf_pool)
 {
 	struct rte_eth_conf port_conf = port_conf_default;
-	const uint16_t rx_rings = 1, tx_rings = 1;
+	const uint16_t rx_rings = nb_rx_queue, tx_rings = nb_tx_queue;
 	uint16_t nb_rxd = RX_RING_SIZE;
 	uint16_t nb_txd = TX_RING_SIZE;
 	int retval;
@@ -162,10 +353,63 @@ __port_init(uint16_t port, struct rte_mempool *mbuf_pool)
 		return retval;
 	}
 
-	if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MBUF_FAST_FREE)
+	if (dev_info.max_tx_queues < tx_rings) {
+		LOG_ERROR("Port %u supports only %u TX queues", port,
+				dev_info.max_tx_queues);
+		return -EINVAL;
+	}
+
+	if (dev_info.max_rx_queues < rx_rings) {
+		LOG_ERROR("Port %u supports only %u RX queues", port,
+				dev_info.max_rx_queues);
+		return -EINVAL;
+	}
+
+	/* Spread the flows over the RX queues */
+	if (rx_rings > 1) {
+		port_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+		port_conf.rx_adv_conf.rss_conf.rss_key = NULL;
+		port_conf.rx_adv_conf.rss_conf.rss_hf =
+			(ETH_RSS_IP | ETH_RSS_UDP | ETH_RSS_TCP) &
+			dev_info.flow_type_rss_offloads;
+		if (port_conf.rx_adv_conf.rss_conf.rss_hf == 0)
+			LOG_INFO("Port %u doesn't support RSS on IP/UDP/TCP, "
+					"all packets may go to RX queue 0", port);
+	}
+
+	/* Split packets are chained from several pools and indirect mbufs,
+	 * and replayed pcap packets are sent by reference along with copies
+	 * from another pool, which rules out fast free */
+	if (is_split) {
+		if (!(dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MULTI_SEGS)) {
+			LOG_ERROR("Port %u doesn't support multi-segment TX", port);
+			return -ENOTSUP;
+		}
+		port_conf.txmode.offloads |= DEV_TX_OFFLOAD_MULTI_SEGS;
+	} else if (tx_type != TX_TYPE_PCAP
+			&& (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MBUF_FAST_FREE))
 		port_conf.txmode.offloads |=
 			DEV_TX_OFFLOAD_MBUF_FAST_FREE;
 
+	/* Let the NIC compute the IPv4/L4 checksums when it can, packets are
+	 * sent from port 0 only */
+	port_conf.txmode.offloads |= dev_info.tx_offload_capa &
+			(DEV_TX_OFFLOAD_IPV4_CKSUM | DEV_TX_OFFLOAD_UDP_CKSUM |
+			 DEV_TX_OFFLOAD_TCP_CKSUM);
+	if (port == 0)
+		pkt_seq_set_cksum_offload(port_conf.txmode.offloads);
+
+	/* Packets are received on port 1 only */
+	if (is_hw_rx_ts && port == 1) {
+		if (dev_info.rx_offload_capa & DEV_RX_OFFLOAD_TIMESTAMP)
+			port_conf.rxmode.offloads |= DEV_RX_OFFLOAD_TIMESTAMP;
+		else {
+			LOG_INFO("Port %u doesn't support RX timestamps, "
+					"use software ones", port);
+			is_hw_rx_ts = false;
+		}
+	}
+
 	/* Configure the Ethernet device. */
 	retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
 	if (retval != 0)
@@ -175,7 +419,7 @@ __port_init(uint16_t port, struct rte_mempool *mbuf_pool)
 	if (retval != 0)
 		return retval;
 
-	/* Allocate and set up 1 RX queue per Ethernet port. */
+	/* Allocate and set up the RX queues, one per RX core. */
 	for (q = 0; q < rx_rings; q++) {
 		retval = rte_eth_rx_queue_setup(port, q, nb_rxd,
 				rte_eth_dev_socket_id(port), NULL, mbuf_pool);
@@ -185,7 +429,7 @@ __port_init(uint16_t port, struct rte_mempool *mbuf_pool)
 
 	txconf = dev_info.default_txconf;
 	txconf.offloads = port_conf.txmode.offloads;
-	/* Allocate and set up 1 TX queue per Ethernet port. */
+	/* Allocate and set up the TX queues, one per TX core. */
 	for (q = 0; q < tx_rings; q++) {
 		retval = rte_eth_tx_queue_setup(port, q, nb_txd,
 				rte_eth_dev_socket_id(port), &txconf);
@@ -221,26 +465,29 @@ __port_init(uint16_t port, struct rte_mempool *mbuf_pool)
 
 static int __lcore_main(__attribute__((__unused__))void *arg)
 {
-	unsigned lcoreid, workerid;
+	unsigned lcoreid, workerid, queue = 0;
 //	struct measure_param measure = {
 //		.sender = sender_id,
 //		.mp = mp,
 //	};
 
 	lcoreid = rte_lcore_id();
-	workerid = ctl_get_workerid(lcoreid);
+	workerid = ctl_get_workerid(lcoreid, &queue);
 
 	if (workerid == WORKER_MAX) {
 		LOG_INFO("Lcore %u is unused", lcoreid);
-		return;
+		return 0;
 	}
 
-	LOG_INFO("lcore %u (worker %u) started.", lcoreid, workerid);
+	LOG_INFO("lcore %u (worker %u, queue %u) started.",
+				lcoreid, workerid, queue);
 
 	if (workerid == WORKER_RX)
-		rx_thread_run_rx(1);
+		rx_thread_run_rx(1, queue);
 	else if (workerid == WORKER_TX)
-		tx_thread_run_tx(0, mbuf_pool, tx_type, NULL, trace_file);
+		tx_thread_run_tx(0, queue);
+	else if (workerid == WORKER_CAP)
+		cap_thread_run();
 	else {
 		stat_thread_run();
 	}
@@ -256,7 +503,8 @@ int main(int argc, char *argv[])
 //	bool is_create_stat = false;
 //	pthread_t tid;
 //	struct measure_param param;
-	unsigned nb_ports, portid;
+	unsigned nb_ports, portid, nb_cores;
+	struct rte_eth_link link;
 
 	if ((retval = rte_eal_init(argc, argv)) < 0) {
 		LOG_ERROR("Failed to initialize dpdk eal");
@@ -270,11 +518,6 @@ int main(int argc, char *argv[])
 	nb_ports = rte_eth_dev_count_avail();
 	if (nb_ports != 2)
 		rte_exit(EXIT_FAILURE, "Error: number of ports must be 2\n");
-	if (rte_lcore_count() < 3)
-		rte_exit(EXIT_FAILURE, "Error: at least 3 cores are needed\n");
-	if (rte_lcore_count() > 3)
-		LOG_INFO("Only the first 3 cores will be used");
-	__set_lcore();
 
 //	pkt_seq_init(&pkt_seq);
 
@@ -282,8 +525,22 @@ int main(int argc, char *argv[])
 		rte_exit(EXIT_FAILURE, "Invalid command-line arguments\n");
 	}
 
-	/* Creates a new mempool in memory to hold the mbufs. */
-	mbuf_pool = rte_pktmbuf_pool_create("MBUF_POOL", NUM_MBUFS * nb_ports,
+	nb_cores = 1 + nb_tx_queue + nb_rx_queue + (cap_is_enabled() ? 1 : 0);
+	if (rte_lcore_count() < nb_cores)
+		rte_exit(EXIT_FAILURE, "Error: at least %u cores are needed\n",
+					nb_cores);
+	if (rte_lcore_count() > nb_cores)
+		LOG_INFO("Only the first %u cores will be used", nb_cores);
+	__set_lcore();
+
+	/* Creates a new mempool in memory to hold the mbufs.
+	 * Every extra TX queue may hold a full TX ring and a cache, and
+	 * every extra RX queue a full RX ring on each port and a cache.
+	 * The capture rings hold received mbufs too. */
+	mbuf_pool = rte_pktmbuf_pool_create("MBUF_POOL", NUM_MBUFS * nb_ports
+		+ (nb_tx_queue - 1) * (TX_RING_SIZE + MBUF_CACHE_SIZE)
+		+ (nb_rx_queue - 1) * (RX_RING_SIZE * nb_ports + MBUF_CACHE_SIZE)
+		+ (cap_is_enabled() ? nb_rx_queue * CAP_RING_SIZE : 0),
 		MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
 
 	if (mbuf_pool == NULL)
@@ -298,6 +555,28 @@ int main(int argc, char *argv[])
 			rte_exit(EXIT_FAILURE, "Cannot init port %"PRIu16 "\n",
 					portid);
 
+	/* link speeds are read by the line rate and the RX timestamps */
+	RTE_ETH_FOREACH_DEV(portid)
+		__wait_link_up(portid);
+
+	/* Line rate of the TX port, for rates given in percent */
+	memset(&link, 0, sizeof(struct rte_eth_link));
+	if (rte_eth_link_get(0, &link) == 0 && link.link_status == ETH_LINK_UP
+					&& link.link_speed != ETH_SPEED_NUM_NONE)
+		rate_set_line_speed((uint64_t)link.link_speed * 1000000);
+	else
+		LOG_ERROR("Unknown link speed of port 0, rates in %% of the line "
+					"rate cannot be used");
+
+	if (is_hw_rx_ts && !rx_enable_hw_timestamp(1))
+		LOG_INFO("Fall back to software RX timestamps");
+
+	if (!tx_init(nb_tx_queue, mbuf_pool, tx_type, NULL, trace_file))
+		rte_exit(EXIT_FAILURE, "Cannot initialize TX\n");
+
+	if (!cap_init(nb_rx_queue))
+		rte_exit(EXIT_FAILURE, "Cannot initialize capture\n");
+
 //	if (is_create_stat) {
 //		if (pthread_create(&tid, NULL, (void *)measure_thread_run, &param)) {
 //			rte_exit(EXIT_FAILURE, "Cannot create statistics thread\n");
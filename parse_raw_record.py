@@ -2,18 +2,75 @@ import struct
 import sys
 import os
 
+# Latency packet id: TX queue in the top byte, load step in the next
+# 16 bits, per-queue sequence below
+def get_step(id):
+    return (id >> 40) & 0xffff
+
 def get_plain_filename(rawfile):
     (name, ext) = os.path.splitext(rawfile)
     return name + "_lat.txt"
 
-def parse_raw(rawfile):
-    outfile = open(get_plain_filename(rawfile), mode='w')
-    infile = open(rawfile, mode="rb")
+# Compact records (-z), see struct stat_lat_enc in stat.h
+ENC_MAGIC = b"PKTLATZ1"
+ENC_SLOTS = 16
+ENC_ESCAPE = ENC_SLOTS - 1
+MASK64 = (1 << 64) - 1
+
+def get_varint(buf, pos):
+    val = 0
+    shift = 0
+    while True:
+        byte = buf[pos]
+        pos += 1
+        val |= (byte & 0x7f) << shift
+        if byte < 0x80:
+            return (val, pos)
+        shift += 7
+
+def unzigzag(val):
+    return (val >> 1) ^ -(val & 1)
+
+def read_compact(infile):
+    (hz,) = struct.unpack("<Q", infile.read(8))
+    buf = infile.read()
+    prev_id = [slot << 56 for slot in range(ENC_SLOTS)]
+    prev_tx = [0] * ENC_SLOTS
+    pos = 0
+    while pos < len(buf):
+        (val, pos) = get_varint(buf, pos)
+        slot = val & 0xf
+        if slot == ENC_ESCAPE:
+            (id, pos) = get_varint(buf, pos)
+        else:
+            id = (prev_id[slot] + unzigzag(val >> 4)) & MASK64
+        (val, pos) = get_varint(buf, pos)
+        tx = (prev_tx[slot] + unzigzag(val)) & MASK64
+        (val, pos) = get_varint(buf, pos)
+        rx = (tx + unzigzag(val)) & MASK64
+        prev_id[slot] = id
+        prev_tx[slot] = tx
+        yield (hz, id, tx, rx)
+
+def read_raw(infile):
     byte = infile.read(24)
     while byte:
         (id, tx, rx) = struct.unpack("<3Q", byte)
-        outfile.write("{0}\t{1}\n".format(id, (float(rx - tx) / 2100)))
+        yield (2100000000, id, tx, rx)
         byte = infile.read(24)
+
+def parse_raw(rawfile):
+    outfile = open(get_plain_filename(rawfile), mode='w')
+    infile = open(rawfile, mode="rb")
+    if infile.read(len(ENC_MAGIC)) == ENC_MAGIC:
+        records = read_compact(infile)
+    else:
+        infile.seek(0)
+        records = read_raw(infile)
+    for (hz, id, tx, rx) in records:
+        outfile.write("{0}\t{1}\t{2}\n".format(id,
+                                              (float(rx - tx) * 1e6 / hz),
+                                              get_step(id)))
     infile.close()
     outfile.close()
 
@@ -0,0 +1,32 @@
+#ifndef _PKTGEN_PCAP_FILE_H_
+#define _PKTGEN_PCAP_FILE_H_
+
+#include <stdint.h>
+
+/* pcap file format, written by the capture and read by the replay.
+ * Files in the other byte order have the magics byte swapped. */
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+#define PCAP_LINK_EN10MB 1
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+/* ts_frac is in usec or nsec, depending on the magic */
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_frac;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+#endif /* _PKTGEN_PCAP_FILE_H_ */
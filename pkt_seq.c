@@ -19,7 +19,9 @@ static struct rte_ether_addr mac_dst = {
 	.addr_bytes = {21},
 };
 
-static uint64_t pkt_idx = 0;
+/* Checksum offloads negotiated on the TX port, software checksums
+ * are used for the others */
+static uint64_t cksum_offload = 0;
 
 static void __parse_mac_addr(const char *str,
 				struct rte_ether_addr *addr)
@@ -68,6 +70,40 @@ void pkt_seq_set_default_mac(void)
 	__parse_mac_addr(PKT_SEQ_MAC_DST, &mac_dst);
 }
 
+void pkt_seq_set_cksum_offload(uint64_t offloads)
+{
+	cksum_offload = offloads & (DEV_TX_OFFLOAD_IPV4_CKSUM |
+					DEV_TX_OFFLOAD_UDP_CKSUM | DEV_TX_OFFLOAD_TCP_CKSUM);
+	LOG_INFO("Checksum offload: IPv4 %s, UDP %s, TCP %s",
+				(cksum_offload & DEV_TX_OFFLOAD_IPV4_CKSUM) ? "on" : "off",
+				(cksum_offload & DEV_TX_OFFLOAD_UDP_CKSUM) ? "on" : "off",
+				(cksum_offload & DEV_TX_OFFLOAD_TCP_CKSUM) ? "on" : "off");
+}
+
+static inline bool __l4_cksum_offload(uint8_t proto)
+{
+	if (proto == IPPROTO_TCP)
+		return (cksum_offload & DEV_TX_OFFLOAD_TCP_CKSUM) != 0;
+	return (cksum_offload & DEV_TX_OFFLOAD_UDP_CKSUM) != 0;
+}
+
+void pkt_seq_set_tx_offload(struct rte_mbuf *mbuf, uint8_t proto)
+{
+	uint64_t ol_flags = 0;
+
+	if (cksum_offload & DEV_TX_OFFLOAD_IPV4_CKSUM)
+		ol_flags |= PKT_TX_IP_CKSUM;
+	if (__l4_cksum_offload(proto))
+		ol_flags |= (proto == IPPROTO_TCP) ?
+						PKT_TX_TCP_CKSUM : PKT_TX_UDP_CKSUM;
+	if (ol_flags)
+		ol_flags |= PKT_TX_IPV4;
+
+	mbuf->ol_flags = ol_flags;
+	mbuf->l2_len = sizeof(struct rte_ether_hdr);
+	mbuf->l3_len = sizeof(struct rte_ipv4_hdr);
+}
+
 void pkt_seq_init(struct pkt_seq_info *info)
 {
 	info->src_ip = PKT_SEQ_IP_SRC;
@@ -89,11 +125,15 @@ static void __setup_ip_hdr(struct rte_ipv4_hdr *ip)
 	ip->fragment_offset = 0;
 	ip->time_to_live = IP_TTL_DEF;
 
-	/* Compute IPv4 header checksum */
-	ip->hdr_checksum = rte_ipv4_cksum(ip);
+	/* Compute IPv4 header checksum, the NIC fills it if offloaded */
+	if (cksum_offload & DEV_TX_OFFLOAD_IPV4_CKSUM)
+		ip->hdr_checksum = 0;
+	else
+		ip->hdr_checksum = rte_ipv4_cksum(ip);
 }
 
-void pkt_seq_setup_tcpip(struct pkt_seq_info *info,
+/* Setup TCP/IP header fields except the checksums */
+static void __setup_tcpip_fields(struct pkt_seq_info *info,
 				struct tcpip_hdr *tcpip, bool is_latency)
 {
 	memset(tcpip, 0, sizeof(struct tcpip_hdr));
@@ -119,10 +159,19 @@ void pkt_seq_setup_tcpip(struct pkt_seq_info *info,
 		tcpip->ip.packet_id = PKT_SEQ_LATENCY_PKTID;
 	else
 		tcpip->ip.packet_id = 0;
+}
 
-	/* Calculate tcp checksum */
+void pkt_seq_setup_tcpip(struct pkt_seq_info *info,
+				struct tcpip_hdr *tcpip, bool is_latency)
+{
+	__setup_tcpip_fields(info, tcpip, is_latency);
+
+	/* Calculate tcp checksum, only the pseudo header one if offloaded */
 //	tlen = info->pkt_len - sizeof(struct rte_ether_hdr);
-	tcpip->tcp.cksum = rte_ipv4_udptcp_cksum(
+	if (__l4_cksum_offload(IPPROTO_TCP))
+		tcpip->tcp.cksum = rte_ipv4_phdr_cksum(&tcpip->ip, 0);
+	else
+		tcpip->tcp.cksum = rte_ipv4_udptcp_cksum(
 					&(tcpip->ip), (const void *)&(tcpip->tcp));
 
 	LOG_DEBUG("IP len %u", (info->pkt_len - sizeof(struct rte_ether_hdr)));
@@ -158,14 +207,17 @@ void pkt_seq_setup_udpip(struct pkt_seq_info *info,
 	else
 		ip->packet_id = 0;
 
-	/* Calculate UDP checksum */
-	udp->dgram_cksum = 0;
+	/* Calculate UDP checksum, left out unless the NIC does it */
+	if (__l4_cksum_offload(IPPROTO_UDP))
+		udp->dgram_cksum = rte_ipv4_phdr_cksum(ip, 0);
+	else
+		udp->dgram_cksum = 0;
 
 	/* Setup remaining part of ip header */
 	__setup_ip_hdr(ip);
 }
 
-static void __setup_latency(struct rte_mbuf *mbuf)
+static void __setup_latency(struct rte_mbuf *mbuf, uint64_t id)
 {
 	struct pkt_latency *lat = NULL;
 
@@ -176,16 +228,21 @@ static void __setup_latency(struct rte_mbuf *mbuf)
 	}
 	lat = rte_pktmbuf_mtod_offset(mbuf, struct pkt_latency*,
 						mbuf->pkt_len - sizeof(struct pkt_latency));
-	lat->id = pkt_idx;
+	lat->id = id;
 	lat->timestamp = rte_get_tsc_cycles();
 //	LOG_INFO("Setup pkt %p:%lu", (void*)mbuf, lat->id);
-	pkt_idx ++;
+}
+
+static inline void __setup_eth_hdr(struct rte_ether_hdr *eth_hdr)
+{
+	rte_ether_addr_copy(&mac_src, &eth_hdr->s_addr);
+	rte_ether_addr_copy(&mac_dst, &eth_hdr->d_addr);
+	eth_hdr->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
 }
 
 void pkt_seq_fill_mbuf(struct rte_mbuf *mbuf, struct pkt_seq_info *info,
-						bool is_latency)
+						bool is_latency, uint64_t lat_id)
 {
-	struct rte_ether_hdr *eth_hdr;
 	// uint8_t *payload = NULL;
 	// unsigned len = 0;
 
@@ -212,7 +269,7 @@ void pkt_seq_fill_mbuf(struct rte_mbuf *mbuf, struct pkt_seq_info *info,
 	// memset(payload, 0, len);
 	// LOG_DEBUG("payload len %u", len);
 	if (is_latency)
-		__setup_latency(mbuf);
+		__setup_latency(mbuf, lat_id);
 
 	/* Setup TCP/UDP+IP */
 	if (info->proto == IPPROTO_TCP) {
@@ -231,10 +288,8 @@ void pkt_seq_fill_mbuf(struct rte_mbuf *mbuf, struct pkt_seq_info *info,
 	}
 
 	/* Setup Ethernet header */
-	eth_hdr = rte_pktmbuf_mtod(mbuf, struct rte_ether_hdr*);
-	rte_ether_addr_copy(&mac_src, &eth_hdr->s_addr);
-	rte_ether_addr_copy(&mac_dst, &eth_hdr->d_addr);
-	eth_hdr->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+	__setup_eth_hdr(rte_pktmbuf_mtod(mbuf, struct rte_ether_hdr*));
+	pkt_seq_set_tx_offload(mbuf, info->proto);
 
 	// /* Setup Eth FCS */
 	// crc = rte_pktmbuf_mtod_offset(mbuf, uint32_t*, info->pkt_len);
@@ -242,6 +297,361 @@ void pkt_seq_fill_mbuf(struct rte_mbuf *mbuf, struct pkt_seq_info *info,
 	// 				info->pkt_len, 0);
 }
 
+/* TCP checksum of a packet whose payload is payload_len zeroed bytes
+ * followed by the latency fields lat (all zeroed too if lat is NULL) */
+static uint16_t __zero_payload_tcp_cksum(struct tcpip_hdr *tcpip,
+				struct pkt_latency *lat, unsigned payload_len)
+{
+	uint32_t sum = 0;
+	uint16_t lat_sum = 0;
+
+	sum = rte_ipv4_phdr_cksum(&tcpip->ip, 0);
+	if (__l4_cksum_offload(IPPROTO_TCP))
+		return (uint16_t)sum;
+
+	sum += rte_raw_cksum(&tcpip->tcp, sizeof(struct rte_tcp_hdr));
+
+	/* the zeroed payload adds nothing, but shifts the latency fields
+	 * by one byte when its length is odd */
+	if (lat) {
+		lat_sum = rte_raw_cksum(lat, sizeof(struct pkt_latency));
+		if (payload_len & 1)
+			lat_sum = (lat_sum << 8) | (lat_sum >> 8);
+		sum += lat_sum;
+	}
+
+	sum = ((sum & 0xffff0000) >> 16) + (sum & 0xffff);
+	sum = ((sum & 0xffff0000) >> 16) + (sum & 0xffff);
+	sum = (~sum) & 0xffff;
+	if (sum == 0)
+		sum = 0xffff;
+	return (uint16_t)sum;
+}
+
+/* Build a packet as a chain of three segments: the headers in hdr, the
+ * shared zeroed payload attached to the indirect mbuf ind, and the
+ * latency fields in tail. Only the small hdr/tail mbufs are written. */
+void pkt_seq_fill_split(struct rte_mbuf *hdr, struct rte_mbuf *ind,
+				struct rte_mbuf *tail, struct rte_mbuf *payload,
+				struct pkt_seq_info *info, bool is_latency, uint64_t lat_id)
+{
+	unsigned hdr_len = pkt_seq_hdr_len(info);
+	unsigned payload_len = 0;
+	struct pkt_latency *lat = NULL;
+
+	payload_len = info->pkt_len - hdr_len - sizeof(struct pkt_latency);
+
+	/* Setup tail */
+	tail->data_len = sizeof(struct pkt_latency);
+	tail->pkt_len = sizeof(struct pkt_latency);
+	lat = rte_pktmbuf_mtod(tail, struct pkt_latency *);
+	if (is_latency) {
+		lat->id = lat_id;
+		lat->timestamp = rte_get_tsc_cycles();
+	} else {
+		memset(lat, 0, sizeof(struct pkt_latency));
+	}
+
+	/* Setup payload */
+	rte_pktmbuf_attach(ind, payload);
+	ind->data_len = payload_len;
+	ind->next = tail;
+
+	/* Setup headers */
+	hdr->data_len = hdr_len;
+	hdr->pkt_len = info->pkt_len;
+	hdr->nb_segs = 3;
+	hdr->next = ind;
+
+	if (info->proto == IPPROTO_TCP) {
+		struct tcpip_hdr *tcpip = NULL;
+
+		tcpip = rte_pktmbuf_mtod_offset(hdr, struct tcpip_hdr*,
+						sizeof(struct rte_ether_hdr));
+		__setup_tcpip_fields(info, tcpip, is_latency);
+		tcpip->tcp.cksum = __zero_payload_tcp_cksum(tcpip, lat, payload_len);
+		__setup_ip_hdr(&tcpip->ip);
+	} else {
+		struct udpip_hdr *udpip;
+
+		udpip = rte_pktmbuf_mtod_offset(hdr, struct udpip_hdr*,
+						sizeof(struct rte_ether_hdr));
+		pkt_seq_setup_udpip(info, udpip, is_latency);
+	}
+
+	__setup_eth_hdr(rte_pktmbuf_mtod(hdr, struct rte_ether_hdr*));
+	pkt_seq_set_tx_offload(hdr, info->proto);
+}
+
+/* Build the header image of a flow, checksums computed for a zeroed
+ * payload and zeroed latency fields. The mbuf offload fields are not
+ * part of the image, see pkt_seq_set_tx_offload(). */
+void pkt_seq_build_hdr_img(struct pkt_seq_info *info,
+				struct pkt_seq_hdr_img *img, bool is_latency)
+{
+	struct rte_ether_hdr *eth_hdr = (struct rte_ether_hdr *)img->data;
+
+	memset(img, 0, sizeof(struct pkt_seq_hdr_img));
+
+	if (info->proto == IPPROTO_TCP) {
+		struct tcpip_hdr *tcpip = (struct tcpip_hdr *)(eth_hdr + 1);
+
+		__setup_tcpip_fields(info, tcpip, is_latency);
+		tcpip->tcp.cksum = __zero_payload_tcp_cksum(tcpip, NULL, 0);
+		__setup_ip_hdr(&tcpip->ip);
+	} else {
+		pkt_seq_setup_udpip(info, (struct udpip_hdr *)(eth_hdr + 1),
+						is_latency);
+	}
+
+	__setup_eth_hdr(eth_hdr);
+}
+
+/* The L4 checksum holds the pseudo header sum if offloaded, the full
+ * complemented checksum otherwise */
+static inline uint16_t __adjust_l4_cksum(uint16_t cksum, uint8_t proto,
+				uint16_t old_sum, uint16_t new_sum)
+{
+	if (__l4_cksum_offload(proto))
+		return pkt_seq_cksum_adjust_sum(cksum, old_sum, new_sum);
+	return pkt_seq_cksum_adjust(cksum, old_sum, new_sum);
+}
+
+/* Rewrite the IPv4 addresses of a packet built by pkt_seq_fill_mbuf(),
+ * adjusting the IPv4 and L4 (pseudo header) checksums incrementally */
+void pkt_seq_update_addr(struct rte_mbuf *mbuf,
+				uint32_t src_ip, uint32_t dst_ip)
+{
+	struct rte_ipv4_hdr *ip = NULL;
+	uint16_t old_sum = 0, new_sum = 0;
+
+	ip = rte_pktmbuf_mtod_offset(mbuf, struct rte_ipv4_hdr *,
+					sizeof(struct rte_ether_hdr));
+	old_sum = pkt_seq_cksum_sum32(ip->src_addr, ip->dst_addr);
+
+	ip->src_addr = rte_cpu_to_be_32(src_ip);
+	ip->dst_addr = rte_cpu_to_be_32(dst_ip);
+	new_sum = pkt_seq_cksum_sum32(ip->src_addr, ip->dst_addr);
+
+	if (!(cksum_offload & DEV_TX_OFFLOAD_IPV4_CKSUM))
+		ip->hdr_checksum = pkt_seq_cksum_adjust(ip->hdr_checksum,
+						old_sum, new_sum);
+
+	if (ip->next_proto_id == IPPROTO_TCP) {
+		struct rte_tcp_hdr *tcp = (struct rte_tcp_hdr *)(ip + 1);
+
+		tcp->cksum = __adjust_l4_cksum(tcp->cksum, IPPROTO_TCP,
+						old_sum, new_sum);
+	} else if (__l4_cksum_offload(IPPROTO_UDP)) {
+		/* UDP checksum is left out unless offloaded */
+		struct rte_udp_hdr *udp = (struct rte_udp_hdr *)(ip + 1);
+
+		udp->dgram_cksum = __adjust_l4_cksum(udp->dgram_cksum, IPPROTO_UDP,
+						old_sum, new_sum);
+	}
+}
+
+/* TCP header of a packet whose TCP checksum covers the payload, i.e.
+ * is computed in software. Nothing to adjust when the NIC computes it,
+ * the payload is not in the pseudo header checksum. */
+static inline struct rte_tcp_hdr *__get_sw_cksum_tcp_hdr(struct rte_mbuf *mbuf)
+{
+	struct rte_ipv4_hdr *ip = NULL;
+
+	ip = rte_pktmbuf_mtod_offset(mbuf, struct rte_ipv4_hdr *,
+					sizeof(struct rte_ether_hdr));
+	if (ip->next_proto_id != IPPROTO_TCP || __l4_cksum_offload(IPPROTO_TCP))
+		return NULL;
+	return (struct rte_tcp_hdr *)(ip + 1);
+}
+
+/* Set or clear the latency marker of a packet built by pkt_seq_fill_mbuf(),
+ * adjusting the IPv4 checksum incrementally. The L4 checksums don't
+ * cover the IP id. */
+void pkt_seq_set_latency_mark(struct rte_mbuf *mbuf, bool is_latency)
+{
+	struct rte_ipv4_hdr *ip = NULL;
+	uint16_t id = is_latency ? PKT_SEQ_LATENCY_PKTID : 0;
+
+	ip = rte_pktmbuf_mtod_offset(mbuf, struct rte_ipv4_hdr *,
+					sizeof(struct rte_ether_hdr));
+	if (ip->packet_id == id)
+		return;
+
+	if (!(cksum_offload & DEV_TX_OFFLOAD_IPV4_CKSUM))
+		ip->hdr_checksum = pkt_seq_cksum_adjust(ip->hdr_checksum,
+						ip->packet_id, id);
+	ip->packet_id = id;
+}
+
+/* Only stamp the latency fields of a packet built by pkt_seq_fill_mbuf(),
+ * adjusting the TCP checksum incrementally */
+void pkt_seq_update_latency(struct rte_mbuf *mbuf, uint64_t lat_id)
+{
+	struct rte_tcp_hdr *tcp = NULL;
+	struct pkt_latency *lat = NULL;
+	uint16_t old_sum = 0;
+
+	tcp = __get_sw_cksum_tcp_hdr(mbuf);
+	lat = rte_pktmbuf_mtod_offset(mbuf, struct pkt_latency*,
+					mbuf->pkt_len - sizeof(struct pkt_latency));
+
+	if (tcp)
+		old_sum = rte_raw_cksum(lat, sizeof(struct pkt_latency));
+
+	__setup_latency(mbuf, lat_id);
+
+	if (tcp)
+		tcp->cksum = pkt_seq_cksum_adjust_lat(tcp->cksum, old_sum,
+						rte_raw_cksum(lat, sizeof(struct pkt_latency)),
+						mbuf->pkt_len);
+}
+
+/* Only rewrite the TX timestamp of a packet built by pkt_seq_fill_mbuf()
+ * or pkt_seq_fill_split(), adjusting the TCP checksum incrementally */
+void pkt_seq_update_timestamp(struct rte_mbuf *mbuf, uint64_t timestamp)
+{
+	struct rte_mbuf *last = rte_pktmbuf_lastseg(mbuf);
+	struct rte_tcp_hdr *tcp = NULL;
+	struct pkt_latency *lat = NULL;
+	uint16_t old_sum = 0;
+
+	tcp = __get_sw_cksum_tcp_hdr(mbuf);
+	lat = rte_pktmbuf_mtod_offset(last, struct pkt_latency*,
+					last->data_len - sizeof(struct pkt_latency));
+
+	if (tcp)
+		old_sum = rte_raw_cksum(&lat->timestamp, sizeof(lat->timestamp));
+
+	lat->timestamp = timestamp;
+
+	if (tcp)
+		tcp->cksum = pkt_seq_cksum_adjust_lat(tcp->cksum, old_sum,
+						rte_raw_cksum(&lat->timestamp, sizeof(lat->timestamp)),
+						mbuf->pkt_len);
+}
+
+/* Captured packets carry their own headers and software checksums.
+ * Only plain IPv4 packets, not fragmented, can take the latency fields:
+ * either at the end of the TCP/UDP payload, which their checksum then
+ * covers, or in the Ethernet padding past the IP packet. */
+static struct rte_ipv4_hdr *__get_raw_ip_hdr(struct rte_mbuf *mbuf,
+				uint16_t *l4_cksum)
+{
+	struct rte_ether_hdr *eth_hdr = NULL;
+	struct rte_ipv4_hdr *ip = NULL;
+	struct rte_tcp_hdr *tcp = NULL;
+	unsigned ip_end = 0, lat_off = 0, l4_off = 0, ihl = 0, tcp_len = 0;
+
+	*l4_cksum = 0;
+	if (mbuf->pkt_len < PKT_SEQ_LATENCY_MINSIZE || mbuf->nb_segs > 1)
+		return NULL;
+
+	eth_hdr = rte_pktmbuf_mtod(mbuf, struct rte_ether_hdr *);
+	if (eth_hdr->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4))
+		return NULL;
+
+	ip = (struct rte_ipv4_hdr *)(eth_hdr + 1);
+	if ((ip->version_ihl >> 4) != 4 || (ip->fragment_offset
+					& rte_cpu_to_be_16(RTE_IPV4_HDR_MF_FLAG
+						| RTE_IPV4_HDR_OFFSET_MASK)))
+		return NULL;
+
+	ihl = (ip->version_ihl & RTE_IPV4_HDR_IHL_MASK) * 4;
+	if (ihl < sizeof(struct rte_ipv4_hdr))
+		return NULL;
+	l4_off = sizeof(struct rte_ether_hdr) + ihl;
+	ip_end = sizeof(struct rte_ether_hdr) + rte_be_to_cpu_16(ip->total_length);
+	lat_off = mbuf->pkt_len - sizeof(struct pkt_latency);
+	if (ip_end > mbuf->pkt_len)
+		return NULL;
+	if (lat_off >= ip_end)
+		return ip;
+	/* the latency fields must not cover part of the L4 header */
+	if (ip_end != mbuf->pkt_len)
+		return NULL;
+
+	if (ip->next_proto_id == IPPROTO_TCP) {
+		/* the TCP header includes its options */
+		if (l4_off + sizeof(struct rte_tcp_hdr) > mbuf->pkt_len)
+			return NULL;
+		tcp = rte_pktmbuf_mtod_offset(mbuf, struct rte_tcp_hdr *, l4_off);
+		tcp_len = (tcp->data_off >> 4) * 4;
+		if (tcp_len < sizeof(struct rte_tcp_hdr)
+						|| l4_off + tcp_len > mbuf->pkt_len
+						|| lat_off < l4_off + tcp_len)
+			return NULL;
+		*l4_cksum = l4_off + offsetof(struct rte_tcp_hdr, cksum);
+	} else if (ip->next_proto_id == IPPROTO_UDP) {
+		if (lat_off < l4_off + sizeof(struct rte_udp_hdr))
+			return NULL;
+		*l4_cksum = l4_off + offsetof(struct rte_udp_hdr, dgram_cksum);
+	} else {
+		/* the checksums of other protocols (ICMP, SCTP...) aren't
+		 * updated, only the padding can take the fields */
+		return NULL;
+	}
+	return ip;
+}
+
+bool pkt_seq_raw_latency_ok(struct rte_mbuf *mbuf)
+{
+	uint16_t l4_cksum = 0;
+
+	return __get_raw_ip_hdr(mbuf, &l4_cksum) != NULL;
+}
+
+/* Set or clear the latency marker of a captured packet */
+void pkt_seq_raw_set_latency_mark(struct rte_mbuf *mbuf, bool is_latency)
+{
+	struct rte_ipv4_hdr *ip = NULL;
+	uint16_t id = is_latency ? PKT_SEQ_LATENCY_PKTID : 0;
+	uint16_t l4_cksum = 0;
+
+	ip = __get_raw_ip_hdr(mbuf, &l4_cksum);
+	if (!ip || ip->packet_id == id)
+		return;
+
+	ip->hdr_checksum = pkt_seq_cksum_adjust(ip->hdr_checksum,
+					ip->packet_id, id);
+	ip->packet_id = id;
+}
+
+/* Mark a captured packet and stamp its latency fields, adjusting the
+ * IPv4 and TCP/UDP checksums incrementally. UDP packets without a
+ * checksum keep none. */
+void pkt_seq_raw_update_latency(struct rte_mbuf *mbuf, uint64_t lat_id)
+{
+	struct pkt_latency *lat = NULL;
+	uint16_t l4_cksum = 0, old_sum = 0, *cksum = NULL;
+
+	if (!__get_raw_ip_hdr(mbuf, &l4_cksum))
+		return;
+
+	pkt_seq_raw_set_latency_mark(mbuf, true);
+
+	lat = rte_pktmbuf_mtod_offset(mbuf, struct pkt_latency*,
+					mbuf->pkt_len - sizeof(struct pkt_latency));
+	if (l4_cksum) {
+		cksum = rte_pktmbuf_mtod_offset(mbuf, uint16_t *, l4_cksum);
+		if (*cksum == 0)
+			cksum = NULL;
+	}
+	if (cksum)
+		old_sum = rte_raw_cksum(lat, sizeof(struct pkt_latency));
+
+	__setup_latency(mbuf, lat_id);
+
+	if (cksum) {
+		*cksum = pkt_seq_cksum_adjust_lat(*cksum, old_sum,
+						rte_raw_cksum(lat, sizeof(struct pkt_latency)),
+						mbuf->pkt_len);
+		/* zero means no checksum for UDP */
+		if (*cksum == 0)
+			*cksum = 0xffff;
+	}
+}
+
 struct pkt_latency *pkt_seq_get_latency(struct rte_mbuf *mbuf)
 {
 	struct rte_ether_hdr *eth_hdr = NULL;
@@ -249,18 +659,15 @@ struct pkt_latency *pkt_seq_get_latency(struct rte_mbuf *mbuf)
 
 	eth_hdr = rte_pktmbuf_mtod(mbuf, struct rte_ether_hdr *);
 
-	if (eth_hdr->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
-		LOG_INFO("Not IPv4");
+	/* unsampled packets take this path, it must stay cheap */
+	if (eth_hdr->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4))
 		return NULL;
-	}
 
 	ip_hdr = rte_pktmbuf_mtod_offset(mbuf, struct rte_ipv4_hdr *,
 					sizeof(struct rte_ether_hdr));
 	if (ip_hdr->packet_id != PKT_SEQ_LATENCY_PKTID ||
-					mbuf->pkt_len < PKT_SEQ_LATENCY_MINSIZE) {
-		LOG_INFO("Not Latency packet");
+					mbuf->pkt_len < PKT_SEQ_LATENCY_MINSIZE)
 		return NULL;
-	}
 
 	return rte_pktmbuf_mtod_offset(mbuf, struct pkt_latency *,
 					mbuf->pkt_len - sizeof(struct pkt_latency));
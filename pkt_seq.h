@@ -28,6 +28,13 @@ struct pkt_seq_info {
 	uint16_t pkt_len;
 };
 
+/* Ready-made Ethernet/IPv4/L4 headers of a flow, checksums included */
+#define PKT_SEQ_HDR_IMG_SIZE 64
+
+struct pkt_seq_hdr_img {
+	uint8_t data[PKT_SEQ_HDR_IMG_SIZE];
+} __rte_cache_aligned;
+
 struct pkt_latency {
 	uint64_t id;
 	uint64_t timestamp;
@@ -66,10 +73,29 @@ struct udpip_hdr {
 #define PKT_SEQ_LATENCY_PKTID 30712
 #define PKT_SEQ_LATENCY_MINSIZE 72
 
+/* Latency packet id: TX queue in the top byte, load step (see rate.h)
+ * in the next 16 bits, per-queue sequence below */
+#define PKT_SEQ_LATENCY_QUEUE_SHIFT 56
+#define PKT_SEQ_LATENCY_ID(queue, seq) \
+			(((uint64_t)(queue) << PKT_SEQ_LATENCY_QUEUE_SHIFT) | (seq))
+#define PKT_SEQ_LATENCY_STEP_SHIFT 40
+#define PKT_SEQ_LATENCY_STEP_MASK (0xffffULL << PKT_SEQ_LATENCY_STEP_SHIFT)
+#define PKT_SEQ_LATENCY_QUEUE(id) ((id) >> PKT_SEQ_LATENCY_QUEUE_SHIFT)
+#define PKT_SEQ_LATENCY_SEQ(id) \
+			((id) & ((1ULL << PKT_SEQ_LATENCY_STEP_SHIFT) - 1))
+#define PKT_SEQ_LATENCY_SET_STEP(id, step) \
+			(((id) & ~PKT_SEQ_LATENCY_STEP_MASK) | \
+			 (((uint64_t)(step) << PKT_SEQ_LATENCY_STEP_SHIFT) & \
+			  PKT_SEQ_LATENCY_STEP_MASK))
+
 void pkt_seq_set_default_mac(void);
 void pkt_seq_set_src_mac(uint16_t portid);
 void pkt_seq_set_dst_mac(uint16_t portid);
 
+void pkt_seq_set_cksum_offload(uint64_t offloads);
+
+void pkt_seq_set_tx_offload(struct rte_mbuf *mbuf, uint8_t proto);
+
 void pkt_seq_init(struct pkt_seq_info *info);
 
 void pkt_seq_setup_udpip(struct pkt_seq_info *info,
@@ -79,11 +105,44 @@ void pkt_seq_setup_tcpip(struct pkt_seq_info *info,
 				struct tcpip_hdr *tcpip, bool is_latency);
 
 void pkt_seq_fill_mbuf(struct rte_mbuf *mbuf,
-				struct pkt_seq_info *info, bool latency);
+				struct pkt_seq_info *info, bool latency, uint64_t lat_id);
+
+void pkt_seq_fill_split(struct rte_mbuf *hdr, struct rte_mbuf *ind,
+				struct rte_mbuf *tail, struct rte_mbuf *payload,
+				struct pkt_seq_info *info, bool is_latency, uint64_t lat_id);
+
+void pkt_seq_build_hdr_img(struct pkt_seq_info *info,
+				struct pkt_seq_hdr_img *img, bool is_latency);
+
+void pkt_seq_update_addr(struct rte_mbuf *mbuf,
+				uint32_t src_ip, uint32_t dst_ip);
+
+void pkt_seq_set_latency_mark(struct rte_mbuf *mbuf, bool is_latency);
+
+void pkt_seq_update_latency(struct rte_mbuf *mbuf, uint64_t lat_id);
+
+void pkt_seq_update_timestamp(struct rte_mbuf *mbuf, uint64_t timestamp);
+
+bool pkt_seq_raw_latency_ok(struct rte_mbuf *mbuf);
+
+void pkt_seq_raw_set_latency_mark(struct rte_mbuf *mbuf, bool is_latency);
+
+void pkt_seq_raw_update_latency(struct rte_mbuf *mbuf, uint64_t lat_id);
 
 struct pkt_latency *pkt_seq_get_latency(struct rte_mbuf *mbuf);
 
 #define ETH_CRC_LEN 4
+/* Bytes a frame takes on the wire besides pkt_len: FCS, preamble + SFD
+ * and inter-frame gap */
+#define PKT_SEQ_WIRE_OVERHEAD (ETH_CRC_LEN + 8 + 12)
+
+/* Length of the Ethernet/IPv4/L4 headers of a packet */
+static inline unsigned pkt_seq_hdr_len(const struct pkt_seq_info *info)
+{
+	if (info->proto == IPPROTO_TCP)
+		return sizeof(struct rte_ether_hdr) + sizeof(struct tcpip_hdr);
+	return sizeof(struct rte_ether_hdr) + sizeof(struct udpip_hdr);
+}
 
 static inline bool copy_buf_to_pkt(void *buf, unsigned len,
 				struct rte_mbuf *pkt, unsigned offset)
@@ -98,4 +157,55 @@ static inline bool copy_buf_to_pkt(void *buf, unsigned len,
 	return false;
 }
 
+/* Incremental checksum update (RFC 1624, eqn. 3): HC' = ~(~HC + ~m + m'),
+ * where m and m' are the one's complement sums of the old and the new
+ * contents of the rewritten fields. All values are taken as they are
+ * stored in the packet. */
+static inline uint16_t pkt_seq_cksum_fold(uint32_t sum)
+{
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return (uint16_t)sum;
+}
+
+static inline uint16_t pkt_seq_cksum_sum32(uint32_t a, uint32_t b)
+{
+	return pkt_seq_cksum_fold((a >> 16) + (a & 0xffff)
+					+ (b >> 16) + (b & 0xffff));
+}
+
+static inline uint16_t pkt_seq_cksum_adjust(uint16_t cksum,
+				uint16_t old_sum, uint16_t new_sum)
+{
+	uint32_t sum = (uint16_t)~cksum;
+
+	sum += (uint16_t)~old_sum;
+	sum += new_sum;
+	return (uint16_t)~pkt_seq_cksum_fold(sum);
+}
+
+/* Same for a field holding a plain sum rather than its complement, like
+ * the pseudo header checksum expected by the L4 checksum offloads */
+static inline uint16_t pkt_seq_cksum_adjust_sum(uint16_t sum16,
+				uint16_t old_sum, uint16_t new_sum)
+{
+	uint32_t sum = sum16;
+
+	sum += (uint16_t)~old_sum;
+	sum += new_sum;
+	return pkt_seq_cksum_fold(sum);
+}
+
+/* The latency fields sit at the end of the frame, so they are not
+ * 16-bit aligned in the TCP segment when the frame length is odd */
+static inline uint16_t pkt_seq_cksum_adjust_lat(uint16_t cksum,
+				uint16_t old_sum, uint16_t new_sum, uint32_t pkt_len)
+{
+	if (pkt_len & 1) {
+		old_sum = (old_sum << 8) | (old_sum >> 8);
+		new_sum = (new_sum << 8) | (new_sum >> 8);
+	}
+	return pkt_seq_cksum_adjust(cksum, old_sum, new_sum);
+}
+
 #endif /* _PERF_PKT_SEQ_H_ */
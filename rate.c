@@ -2,77 +2,347 @@
 #include "rate.h"
 #include "pkt_seq.h"
 
+#include <math.h>
+#include <strings.h>
 #include <rte_cycles.h>
+#include <rte_atomic.h>
+#include <rte_random.h>
 
 #define USEC_PER_SEC	1000000
 
 /* - Cycles per second */
 static uint64_t cycle_per_sec = 0;
 
-static uint64_t __get_cycle_per_pkt(uint64_t tx_bps)
-{
-	if (cycle_per_sec == 0) {
-		cycle_per_sec = rte_get_tsc_hz();
-	}
+/* - Line rate of the TX port in bps, 0 if unknown */
+static uint64_t line_bps = 0;
 
-    uint64_t pps = tx_bps / (8 * PKT_SEQ_PKT_LEN);
+/* - Load profile shared by all TX queues */
+static struct rate_profile profile = {
+	.type = RATE_PROFILE_CONST,
+	.start_cycle = 0,
+};
 
-    if (pps == 0) pps = 1;
+/* - Exponential gaps between packets */
+static bool is_poisson = false;
 
-	return (cycle_per_sec / pps);
-}
+static const char *rate_unit_str[] = {
+	[RATE_UNIT_BPS] = "bps",
+	[RATE_UNIT_PPS] = "pps",
+	[RATE_UNIT_LINE] = "% of line rate",
+};
 
-/* Format: e.g 1000k => 1000 kbps, 2m => 2 mbps,
- * 			   128 => 128 bps
+/* Format: <value>[k|m|g][bps|pps] or <value>%, decimal units,
+ * e.g 1000k => 1000 kbps, 2.5g => 2.5 gbps, 10mpps => 10 mpps,
+ * 			   99.5% => 99.5% of the line rate, 128 => 128 bps
  */
-bool rate_set_rate(const char *rate_str, 
+bool rate_set_rate(const char *rate_str,
 						struct rate_ctl *rate)
 {
-	long val = 0;
+	double val = 0;
 	char *unit = NULL;
-	uint64_t tx_rate = 0;
+	bool is_scaled = true;
 
-	memset(rate, 0, sizeof(struct rate_ctl));
-
-	val = strtol(rate_str, &unit, 10);
-	if (errno == EINVAL || errno == ERANGE
-					|| unit == rate_str) {
+	errno = 0;
+	val = strtod(rate_str, &unit);
+	if (errno == ERANGE || unit == rate_str) {
 		LOG_ERROR("Failed to parse TX rate %s", rate_str);
 		return false;
 	}
 
-	if (val < 0) {
-		LOG_ERROR("Wrong rate value %ld", val);
+	/* strtod() takes "inf" and "nan", which would run unpaced */
+	if (!isfinite(val) || val < 0) {
+		LOG_ERROR("Wrong rate value %s", rate_str);
 		return false;
 	}
 
 	switch(*unit) {
 		case 'k':	case 'K':
-			tx_rate = val << 10;
+			val *= 1e3;
+			unit++;
 			break;
 		case 'm':	case 'M':
-			tx_rate = val << 20;
+			val *= 1e6;
+			unit++;
 			break;
 		case 'g':	case 'G':
-			tx_rate = val << 30;
+			val *= 1e9;
+			unit++;
 			break;
 		default:
-			tx_rate = val;
+			is_scaled = false;
+			break;
+	}
+
+	memset(rate, 0, sizeof(struct rate_ctl));
+	rate->rate = val;
+
+	if (*unit == '\0' || strcasecmp(unit, "bps") == 0)
+		rate->unit = RATE_UNIT_BPS;
+	else if (strcasecmp(unit, "pps") == 0)
+		rate->unit = RATE_UNIT_PPS;
+	else if (strcmp(unit, "%") == 0 && !is_scaled && val <= 100)
+		rate->unit = RATE_UNIT_LINE;
+	else {
+		LOG_ERROR("Wrong rate unit in %s", rate_str);
+		return false;
 	}
+	return true;
+}
+
+void rate_set_line_speed(uint64_t bps)
+{
+	line_bps = bps;
+	LOG_INFO("Line rate %lu bps", line_bps);
+}
+
+/* Format: ramp:<from>:<to>:<seconds>, linear ramp, then stays at <to>
+ *         step:<from>:<to>:<increment>:<seconds per step>, staircase
+ *         sine:<min>:<max>:<period in seconds>, sinusoid
+ * where rates are given as for rate_set_rate(), all in the same unit
+ */
+bool rate_set_profile(const char *profile_str)
+{
+	char *str = NULL, *tok = NULL, *saveptr = NULL;
+	struct rate_ctl val;
+	double arg[4] = {0};
+	unsigned nb_arg = 0, nb_rate = 0, i = 0;
+	bool ret = false;
+
+	str = strdup(profile_str);
+	if (str == NULL)
+		return false;
+
+	tok = strtok_r(str, ":", &saveptr);
+	if (tok == NULL)
+		goto out;
+	if (strcmp(tok, "ramp") == 0) {
+		profile.type = RATE_PROFILE_RAMP;
+		nb_arg = 3;
+		nb_rate = 2;
+	} else if (strcmp(tok, "step") == 0) {
+		profile.type = RATE_PROFILE_STEP;
+		nb_arg = 4;
+		nb_rate = 3;
+	} else if (strcmp(tok, "sine") == 0) {
+		profile.type = RATE_PROFILE_SINE;
+		nb_arg = 3;
+		nb_rate = 2;
+	} else {
+		LOG_ERROR("Unknown load profile %s", tok);
+		goto out;
+	}
+
+	for (i = 0; i < nb_arg; i++) {
+		tok = strtok_r(NULL, ":", &saveptr);
+		if (tok == NULL) {
+			LOG_ERROR("Too few parameters in load profile %s", profile_str);
+			goto out;
+		}
+		if (i < nb_rate) {
+			if (!rate_set_rate(tok, &val))
+				goto out;
+			if (i > 0 && val.unit != profile.unit) {
+				LOG_ERROR("Rates of load profile %s are in different units",
+								profile_str);
+				goto out;
+			}
+			profile.unit = val.unit;
+			arg[i] = val.rate;
+		} else if (!str_to_double(tok, &arg[i]) || arg[i] <= 0) {
+			LOG_ERROR("Wrong duration in load profile %s", profile_str);
+			goto out;
+		}
+	}
+
+	profile.from = arg[0];
+	profile.to = arg[1];
+	if (profile.type == RATE_PROFILE_STEP) {
+		profile.inc = arg[2];
+		if (profile.inc <= 0 || profile.to < profile.from) {
+			LOG_ERROR("Wrong staircase in load profile %s", profile_str);
+			goto out;
+		}
+	}
+	profile.sec = arg[nb_arg - 1];
+	LOG_INFO("Load profile %s", profile_str);
+	ret = true;
+
+out:
+	if (!ret)
+		profile.type = RATE_PROFILE_CONST;
+	free(str);
+	return ret;
+}
+
+void rate_enable_poisson(void)
+{
+	is_poisson = true;
+}
+
+/* The profile starts with the first TX queue to call it */
+void rate_start_profile(uint64_t cycle)
+{
+	rte_atomic64_cmpset(&profile.start_cycle, 0, cycle);
+}
+
+const char *rate_unit_name(unsigned unit)
+{
+	return rate_unit_str[unit];
+}
+
+/* Set rate to its share of level, in the unit of the rate */
+bool rate_set_level(struct rate_ctl *rate, double level)
+{
+	double wire_bps = 0;
+
+	rate->level = level;
+	rate->rate = level / rate->nb_share;
+	rate->cycle_per_pkt = 0;
+	rate->cycle_per_byte = 0;
 
-	rate->rate_bps = tx_rate;
-    rate->cycle_per_pkt = __get_cycle_per_pkt(tx_rate);
-//	rate->cycle_per_byte = __get_cycle_per_byte(tx_rate);
+	switch (rate->unit) {
+		case RATE_UNIT_PPS:
+			if (rate->rate > 0)
+				rate->cycle_per_pkt = cycle_per_sec / rate->rate;
+			break;
+		case RATE_UNIT_LINE:
+			if (line_bps == 0) {
+				LOG_ERROR("Line rate is unknown, cannot send at %.2f%%",
+								level);
+				return false;
+			}
+			wire_bps = line_bps * rate->rate / 100;
+			break;
+		default:
+			wire_bps = rate->rate;
+	}
+	if (wire_bps > 0)
+		rate->cycle_per_byte = 8 * cycle_per_sec / wire_bps;
+	return true;
+}
+
+/* Set rate to 1/nb_share of total, or of the load profile if any, and
+ * compute the packet costs */
+bool rate_set_share(struct rate_ctl *rate,
+				const struct rate_ctl *total, unsigned nb_share)
+{
+	double level = total->rate;
+
+	if (cycle_per_sec == 0) {
+		cycle_per_sec = rte_get_tsc_hz();
+	}
+
+	memset(rate, 0, sizeof(struct rate_ctl));
+	rate->unit = total->unit;
+	rate->nb_share = nb_share;
+
+	if (profile.type != RATE_PROFILE_CONST) {
+		rate->unit = profile.unit;
+		level = profile.from;
+		if (profile.type == RATE_PROFILE_SINE)
+			level = (profile.from + profile.to) / 2;
+	}
+	if (!rate_set_level(rate, level))
+		return false;
+
+	rate->max_credit = RATE_BUCKET_USEC * (cycle_per_sec / USEC_PER_SEC);
 	rate->next_tx_cycle = 0;
-	LOG_INFO("bps %lu, hz %lu, cycle_per_pkt %lu", tx_rate,
-					cycle_per_sec, rate->cycle_per_pkt);
+	rate->step = 0;
+	rate->next_step_cycle = 0;
+	LOG_INFO("rate %.3f %s, hz %lu, cycle_per_pkt %.3f, cycle_per_byte %.6f",
+					rate->rate, rate_unit_str[rate->unit], cycle_per_sec,
+					rate->cycle_per_pkt, rate->cycle_per_byte);
+	return true;
+}
+
+/* Follow the load profile, returns true when a new step begins. Steps
+ * are numbered from 0 at the start of the profile. */
+bool rate_update_step(struct rate_ctl *rate, uint64_t cur_cycle)
+{
+	uint64_t start = profile.start_cycle;
+	uint64_t step = 0, last = 0, step_cycles = 0;
+	double level = 0, sec = 0;
+
+	if (profile.type == RATE_PROFILE_CONST
+					|| cur_cycle < rate->next_step_cycle
+					|| start == 0 || cur_cycle < start)
+		return false;
+
+	if (profile.type == RATE_PROFILE_STEP) {
+		step_cycles = profile.sec * cycle_per_sec;
+		last = (uint64_t)((profile.to - profile.from) / profile.inc + 1e-9);
+	} else {
+		step_cycles = RATE_PROFILE_TICK_MS * (cycle_per_sec / 1000);
+		last = (uint64_t)(profile.sec * 1000 / RATE_PROFILE_TICK_MS);
+	}
+	step = (cur_cycle - start) / step_cycles;
+
+	/* ramps and staircases stay at their last step */
+	if (profile.type != RATE_PROFILE_SINE && step >= last) {
+		step = last;
+		rate->next_step_cycle = UINT64_MAX;
+	} else
+		rate->next_step_cycle = start + (step + 1) * step_cycles;
+
+	sec = (double)step * RATE_PROFILE_TICK_MS / 1000;
+	switch (profile.type) {
+		case RATE_PROFILE_STEP:
+			level = profile.from + step * profile.inc;
+			break;
+		case RATE_PROFILE_RAMP:
+			level = profile.from + (profile.to - profile.from)
+							* RTE_MIN(sec / profile.sec, 1.0);
+			break;
+		default:
+			level = (profile.from + profile.to) / 2 + (profile.to - profile.from)
+							/ 2 * sin(2 * M_PI * sec / profile.sec);
+	}
+
+	/* step tags wrap around for long sinusoids */
+	rate->step = step & RATE_PROFILE_STEP_MAX;
+	rate_set_level(rate, level);
 	return true;
 }
 
+void rate_log_step(const struct rate_ctl *rate)
+{
+	LOG_INFO("Load step %u: %.3f %s", rate->step, rate->level,
+					rate_unit_str[rate->unit]);
+}
+
+/* Sum of nb exponentially distributed gaps of mean 1 */
+static double __exp_gaps(unsigned nb)
+{
+	double sum = 0;
+	unsigned i = 0;
+
+	for (i = 0; i < nb; i++)
+		sum -= log(1.0 - (rte_rand() >> 11) * (1.0 / (1ULL << 53)));
+	return sum;
+}
+
+/* Charge nb_pkt packets of nb_bytes bytes (without wire overhead) sent
+ * at cur_cycle. A sender running late may catch up, but only by up to
+ * max_credit cycles, so that a stall doesn't turn into a long burst. */
 void rate_set_next_cycle(struct rate_ctl *rate,
-				uint64_t cur_cycle, unsigned nb_pkt)
+				uint64_t cur_cycle, unsigned nb_pkt, uint64_t nb_bytes)
 {
-	rate->next_tx_cycle =  cur_cycle + rate->cycle_per_pkt * nb_pkt;
+	double cost = 0;
+	uint64_t cycles = 0;
+
+	cost = nb_pkt * rate->cycle_per_pkt
+			+ (nb_bytes + (uint64_t)nb_pkt * PKT_SEQ_WIRE_OVERHEAD)
+			* rate->cycle_per_byte;
+	/* Poisson arrivals: same mean cost, exponential gaps */
+	if (is_poisson && nb_pkt > 0)
+		cost = cost / nb_pkt * __exp_gaps(nb_pkt);
+	cost += rate->frac;
+	cycles = (uint64_t)cost;
+	rate->frac = cost - cycles;
+
+	if (rate->next_tx_cycle + rate->max_credit < cur_cycle)
+		rate->next_tx_cycle = cur_cycle - rate->max_credit;
+	rate->next_tx_cycle += cycles;
 }
 
 void rate_wait_for_time(uint64_t next_cycle)
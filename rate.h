@@ -4,17 +4,83 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+enum {
+	RATE_UNIT_BPS = 0,	/* bits per second on the wire */
+	RATE_UNIT_PPS,		/* packets per second */
+	RATE_UNIT_LINE,		/* percent of the line rate */
+};
+
+/* Credit a late sender may catch up with, in microseconds */
+#define RATE_BUCKET_USEC 20
+
+/* Load profiles, see rate_set_profile() */
+enum {
+	RATE_PROFILE_CONST = 0,
+	RATE_PROFILE_RAMP,
+	RATE_PROFILE_STEP,
+	RATE_PROFILE_SINE,
+};
+
+/* Ramps and sinusoids are followed in steps of RATE_PROFILE_TICK_MS */
+#define RATE_PROFILE_TICK_MS 100
+#define RATE_PROFILE_STEP_MAX 0xffff
+
+struct rate_profile {
+	unsigned type;
+	unsigned unit;
+	/* ramp/staircase from and to, sinusoid min and max */
+	double from;
+	double to;
+	/* staircase increment */
+	double inc;
+	/* ramp duration, staircase step duration or sinusoid period */
+	double sec;
+	volatile uint64_t start_cycle;
+};
+
+/* Token bucket in TSC cycles: a packet costs cycle_per_pkt plus
+ * cycle_per_byte for each byte it takes on the wire. The fractional
+ * part of the costs is carried over in frac. */
 struct rate_ctl {
-	uint64_t rate_bps;
-//	uint64_t cycle_per_byte;
-    uint64_t cycle_per_pkt;
+	unsigned unit;
+	double rate;
+
+	double cycle_per_pkt;
+	double cycle_per_byte;
+	double frac;
+	uint64_t max_credit;
 	uint64_t next_tx_cycle;
+
+	/* current step of the load profile, rate is the share of level */
+	unsigned nb_share;
+	unsigned step;
+	double level;
+	uint64_t next_step_cycle;
 };
 
 bool rate_set_rate(const char *rate_str, struct rate_ctl *rate);
 
+void rate_set_line_speed(uint64_t bps);
+
+bool rate_set_profile(const char *profile_str);
+
+void rate_enable_poisson(void);
+
+void rate_start_profile(uint64_t cycle);
+
+bool rate_update_step(struct rate_ctl *rate, uint64_t cur_cycle);
+
+void rate_log_step(const struct rate_ctl *rate);
+
+const char *rate_unit_name(unsigned unit);
+
+bool rate_set_level(struct rate_ctl *rate, double level);
+
+bool rate_set_share(struct rate_ctl *rate,
+				const struct rate_ctl *total, unsigned nb_share);
+
 void rate_set_next_cycle(struct rate_ctl *rate,
-                uint64_t cur_cycle, unsigned nb_pkt);
+                uint64_t cur_cycle, unsigned nb_pkt, uint64_t nb_bytes);
 
 void rate_wait_for_time(uint64_t next_cycle);
 
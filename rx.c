@@ -8,99 +8,241 @@
 #include <rte_hash_crc.h>
 #include <rte_random.h>
 
-#include <pcap.h>
-
 #include "util.h"
 #include "control.h"
 #include "rx.h"
 #include "stat.h"
 #include "pkt_seq.h"
 
-static struct rx_ctl rx_ctl = {
-	.dump_to_pcap = false,
-	.pcapfile = {'\0'},
+/* - configuration shared by all RX workers */
+static struct rx_ctl rx_conf = {
+	.queue = 0,
+	.cap = NULL,
 	.is_latency = false,
+	.is_hw_ts = false,
+	.is_sw_ts = false,
+	.rx_cb = NULL,
+	.cycle_per_byte = 0,
+	.drained_cycle = 0,
 	.rx_buf = {NULL}
 };
 
+/* - per-queue RX workers */
+static struct rx_ctl rx_ctls[WORKER_QUEUE_MAX];
+
 void rx_enable_latency(void)
 {
-	rx_ctl.is_latency = true;
+	rx_conf.is_latency = true;
+}
+
+/* Read the NIC clock, paired with the TSC in the middle of the read */
+static int __read_clock(uint16_t portid, uint64_t *nic, uint64_t *tsc)
+{
+	uint64_t before = 0, after = 0;
+	int ret = 0;
+
+	before = rte_get_tsc_cycles();
+	ret = rte_eth_read_clock(portid, nic);
+	after = rte_get_tsc_cycles();
+
+	*tsc = before + (after - before) / 2;
+	return ret;
 }
 
-void rx_set_pcap_output(const char *filename)
+/* The NIC timestamp offload must have been enabled on the port, which
+ * must be started. Measures the NIC clock rate against the TSC. */
+bool rx_enable_hw_timestamp(uint16_t portid)
 {
-	if (strlen(filename) == 0) {
-		snprintf(rx_ctl.pcapfile, FILEPATH_MAX, "rx.pcap");
+	struct rx_hw_clock *clock = &rx_conf.clock;
+	uint64_t nic = 0, tsc = 0;
+
+	if (__read_clock(portid, &nic, &tsc) != 0) {
+		LOG_INFO("Cannot read the clock of port %u", portid);
+		return false;
 	}
-	else {
-		snprintf(rx_ctl.pcapfile, FILEPATH_MAX, "%s", filename);
+
+	rte_delay_ms(RX_CLOCK_CALIB_MS);
+
+	if (__read_clock(portid, &clock->nic_base, &clock->tsc_base) != 0
+					|| clock->nic_base <= nic) {
+		LOG_INFO("Cannot read the clock of port %u", portid);
+		return false;
 	}
-	rx_ctl.dump_to_pcap = true;
+
+	clock->tsc_per_nic = (double)(clock->tsc_base - tsc)
+					/ (clock->nic_base - nic);
+	clock->sync_interval = RX_CLOCK_SYNC_SEC * rte_get_tsc_hz();
+	clock->next_sync_cycle = clock->tsc_base + clock->sync_interval;
+	rx_conf.is_hw_ts = true;
+
+	LOG_INFO("Use hardware RX timestamps, port %u clock %.0f Hz", portid,
+					rte_get_tsc_hz() / clock->tsc_per_nic);
+	return true;
 }
 
-static void __rx_stat_latency(struct rte_mbuf *pkt, uint64_t recv_cyc)
+/* Re-anchor the conversion now and then, so that the error of the
+ * measured rate doesn't accumulate */
+static inline void __sync_clock(int portid, struct rx_hw_clock *clock,
+				uint64_t cycle)
 {
-	struct pkt_latency *lat = NULL;
+	uint64_t nic = 0, tsc = 0;
 
-	lat = pkt_seq_get_latency(pkt);
-	if (!lat)
+	if (cycle < clock->next_sync_cycle)
 		return;
+	if (__read_clock(portid, &nic, &tsc) == 0) {
+		clock->nic_base = nic;
+		clock->tsc_base = tsc;
+	}
+	clock->next_sync_cycle = cycle + clock->sync_interval;
+}
 
-	stat_update_rx_latency(lat->id, lat->timestamp, recv_cyc);
+static inline uint64_t __hw_ts_to_tsc(const struct rx_hw_clock *clock,
+				uint64_t nic)
+{
+	return clock->tsc_base + (int64_t)((double)(int64_t)(nic - clock->nic_base)
+					* clock->tsc_per_nic);
+}
+
+void rx_enable_sw_timestamp(void)
+{
+	rx_conf.is_sw_ts = true;
 }
 
-static void __pcap_dump_pkt(pcap_dumper_t *out,
-							const u_char *pkt, int len,
-							time_t tv_sec, suseconds_t tv_usec)
+/* Per-packet RX times of a burst. The last packet is taken as received
+ * now, the ones before it as back to back on the wire, but not before
+ * the last poll that emptied the RX ring. */
+static uint16_t __rx_timestamp_cb(uint16_t portid __rte_unused,
+				uint16_t queue __rte_unused, struct rte_mbuf *pkts[],
+				uint16_t nb_pkts, uint16_t max_pkts, void *user_param)
 {
-    struct pcap_pkthdr hdr;
-    hdr.ts.tv_sec = tv_sec;
-    hdr.ts.tv_usec = tv_usec;
-    hdr.caplen = len;
-    hdr.len = len; 
+	struct rx_ctl *ctl = (struct rx_ctl *)user_param;
+	uint64_t now = rte_get_tsc_cycles();
+	uint64_t ts = now, wire = 0;
+	int i = 0;
 
-    pcap_dump((u_char*)out, &hdr, pkt); 
+	for (i = nb_pkts - 1; i >= 0; i--) {
+		ctl->rx_ts[i] = ts;
+		wire = (pkts[i]->pkt_len + PKT_SEQ_WIRE_OVERHEAD)
+						* ctl->cycle_per_byte;
+		if (ts > ctl->drained_cycle + wire)
+			ts -= wire;
+		else
+			ts = ctl->drained_cycle;
+	}
+
+	if (nb_pkts < max_pkts)
+		ctl->drained_cycle = now;
+	return nb_pkts;
 }
 
-static int __process_rx(int portid, pcap_dumper_t *pcapout)
+static void __rx_sw_ts_init(int portid, struct rx_ctl *ctl)
+{
+	struct rte_eth_link link;
+
+	memset(&link, 0, sizeof(struct rte_eth_link));
+	/* main() waited for the link to come up, its speed is final */
+	if (rte_eth_link_get(portid, &link) == 0 && link.link_status == ETH_LINK_UP
+					&& link.link_speed != ETH_SPEED_NUM_NONE) {
+		/* link_speed is in Mbps */
+		ctl->cycle_per_byte = 8.0 * rte_get_tsc_hz()
+						/ ((double)link.link_speed * 1000000);
+	} else {
+		LOG_ERROR("Unknown link speed of port %d, no burst skew correction",
+						portid);
+		ctl->cycle_per_byte = 0;
+	}
+
+	ctl->drained_cycle = 0;
+	ctl->rx_cb = rte_eth_add_rx_callback(portid, ctl->queue,
+					__rx_timestamp_cb, ctl);
+	if (ctl->rx_cb == NULL) {
+		LOG_INFO("Cannot add RX callback on queue %u, use burst timestamps",
+						ctl->queue);
+		ctl->is_sw_ts = false;
+	}
+}
+
+static struct rx_ctl *__rx_queue_init(unsigned queue)
+{
+	struct rx_ctl *ctl = &rx_ctls[queue];
+
+	memcpy(ctl, &rx_conf, sizeof(struct rx_ctl));
+	ctl->queue = queue;
+	ctl->cap = cap_get_queue(queue);
+	return ctl;
+}
+
+/* RX time of the i-th packet of the burst: the hardware timestamp if
+ * any, else the software one, else the burst one */
+static inline uint64_t __rx_pkt_cycle(const struct rx_ctl *ctl,
+				const struct rte_mbuf *pkt, uint16_t i, uint64_t recv_cyc)
+{
+	if (ctl->is_hw_ts && (pkt->ol_flags & PKT_RX_TIMESTAMP))
+		return __hw_ts_to_tsc(&ctl->clock, pkt->timestamp);
+	if (ctl->is_sw_ts)
+		return ctl->rx_ts[i];
+	return recv_cyc;
+}
+
+static void __rx_stat_latency(struct rx_ctl *ctl,
+				struct rte_mbuf *pkt, uint64_t recv_cyc)
+{
+	struct pkt_latency *lat = NULL;
+
+	lat = pkt_seq_get_latency(pkt);
+	if (!lat)
+		return;
+
+	stat_update_rx_latency(ctl->queue, lat->id, lat->timestamp, recv_cyc);
+}
+
+static int __process_rx(int portid, struct rx_ctl *ctl)
 {
 	uint16_t nb_rx, i = 0;
-	struct timeval tv;
-	uint64_t recv_cyc = 0;
+	uint64_t recv_cyc = 0, cycle = 0, bytes = 0;
 
-//	recv_cyc = rte_get_tsc_cycles();
-	nb_rx = rte_eth_rx_burst(portid, 0, rx_ctl.rx_buf, RX_BURST);
+	nb_rx = rte_eth_rx_burst(portid, ctl->queue, ctl->rx_buf, RX_BURST);
 	if (nb_rx == 0)
 		return 0;
 
-	if (pcapout)
-		gettimeofday(&tv, NULL);
-	if (rx_ctl.is_latency)
+	if (ctl->is_latency || ctl->cap) {
 		recv_cyc = rte_get_tsc_cycles();
+		if (ctl->is_hw_ts)
+			__sync_clock(portid, &ctl->clock, recv_cyc);
+	}
 
 	for (i = 0; i < nb_rx; i++) {
-		struct rte_mbuf *pkt = rx_ctl.rx_buf[i];
-
-		stat_update_rx(pkt->data_len);
-
-		if (rx_ctl.is_latency)
-			__rx_stat_latency(pkt, recv_cyc);
+		struct rte_mbuf *pkt = ctl->rx_buf[i];
 
-		if (pcapout) {
-			 char *pktbuf = rte_pktmbuf_mtod(pkt, char *);
+		bytes += pkt->data_len;
 
-			__pcap_dump_pkt(pcapout, (const u_char*)pktbuf, pkt->data_len,
-								tv.tv_sec, tv.tv_usec + i);
+		if (!ctl->is_latency && !ctl->cap) {
+			rte_pktmbuf_free(pkt);
+			continue;
 		}
 
-		rte_pktmbuf_free(pkt);
+		cycle = __rx_pkt_cycle(ctl, pkt, i, recv_cyc);
+		if (ctl->is_latency)
+			__rx_stat_latency(ctl, pkt, cycle);
+
+		/* the capture lcore owns the mbuf from now on */
+		if (ctl->cap)
+			pkt->timestamp = cycle;
+		else
+			rte_pktmbuf_free(pkt);
 	}
+
+	if (ctl->cap)
+		cap_enqueue(ctl->cap, ctl->rx_buf, nb_rx);
+
+	stat_update_rx(ctl->queue, bytes, nb_rx);
 	return 0;
 }
 
-void rx_thread_run_rx(int portid)
+void rx_thread_run_rx(int portid, unsigned queue)
 {
+	struct rx_ctl *ctl = NULL;
+
 	/* waiting for stat thread */
 	while (ctl_get_state(WORKER_STAT) == STATE_UNINIT && !ctl_is_stop(WORKER_RX)) {}
 
@@ -108,40 +250,36 @@ void rx_thread_run_rx(int portid)
 					|| ctl_get_state(WORKER_STAT) == STATE_ERROR)
 		return;
 
-	if (portid < 0) {
-		LOG_ERROR("Invalid parameters, portid %d", portid);
-		ctl_set_state(WORKER_RX, STATE_ERROR);
+	if (portid < 0 || queue >= ctl_get_nb_queue(WORKER_RX)) {
+		LOG_ERROR("Invalid parameters, portid %d, queue %u",
+						portid, queue);
+		ctl_set_state(WORKER_RX, queue, STATE_ERROR);
 		return;
 	}
 
-	pcap_dumper_t *pcapout =NULL;
+	ctl = __rx_queue_init(queue);
 
-	if (rx_ctl.dump_to_pcap) {
-		pcapout = pcap_dump_open(pcap_open_dead(DLT_EN10MB, 1600), rx_ctl.pcapfile);
-		if (!pcapout) {
-			LOG_ERROR("Failed to open output pcap file %s", rx_ctl.pcapfile);
-			ctl_set_state(WORKER_RX, STATE_ERROR);
-			return;
-		}
-		LOG_INFO("All packet will be written to pcap file %s", rx_ctl.pcapfile);
-	}
+	if ((ctl->is_latency || ctl->cap) && ctl->is_sw_ts)
+		__rx_sw_ts_init(portid, ctl);
+	else
+		ctl->is_sw_ts = false;
 
-	LOG_INFO("rx running on lcore %u", rte_lcore_id());		
+	LOG_INFO("rx queue %u running on lcore %u", queue, rte_lcore_id());
 
-	ctl_set_state(WORKER_RX, STATE_INITED);
+	ctl_set_state(WORKER_RX, queue, STATE_INITED);
 
 	while (!ctl_is_stop(WORKER_RX)) {
-		if (__process_rx(portid, pcapout) < 0) {
+		if (__process_rx(portid, ctl) < 0) {
 			LOG_ERROR("RX error!");
 			break;
 		}
 	}
 
-	if (pcapout) {
-		pcap_dump_close(pcapout);
-		pcapout = NULL;
+	if (ctl->rx_cb) {
+		rte_eth_remove_rx_callback(portid, queue, ctl->rx_cb);
+		ctl->rx_cb = NULL;
 	}
 
 	LOG_INFO("RX thread quit");
-	ctl_set_state(WORKER_RX, STATE_STOPPED);
+	ctl_set_state(WORKER_RX, queue, STATE_STOPPED);
 }
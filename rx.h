@@ -4,20 +4,49 @@
 #include <stdbool.h>
 #include "stat.h"
 #include "util.h"
+#include "capture.h"
+
+/* Calibration time of the NIC clock and re-anchoring period of the
+ * NIC clock to TSC conversion */
+#define RX_CLOCK_CALIB_MS 100
+#define RX_CLOCK_SYNC_SEC 1
+
+/* NIC clock to TSC conversion of the hardware RX timestamps:
+ * tsc = tsc_base + (nic - nic_base) * tsc_per_nic */
+struct rx_hw_clock {
+	uint64_t nic_base;
+	uint64_t tsc_base;
+	double tsc_per_nic;
+	uint64_t sync_interval;
+	uint64_t next_sync_cycle;
+};
 
 struct rx_ctl {
-	bool dump_to_pcap;
-	char pcapfile[FILEPATH_MAX];
+	unsigned int queue;
+
+	/* NULL without capture */
+	struct cap_queue *cap;
 
 	bool is_latency;
+	bool is_hw_ts;
+	struct rx_hw_clock clock;
 
-	struct rte_mbuf *rx_buf[RX_BURST];
-};
+	/* per-packet software timestamps, taken in an RX callback */
+	bool is_sw_ts;
+	const struct rte_eth_rxtx_callback *rx_cb;
+	double cycle_per_byte;
+	uint64_t drained_cycle;
+	uint64_t rx_ts[RX_BURST];
 
-void rx_set_pcap_output(const char *filename);
+	struct rte_mbuf *rx_buf[RX_BURST];
+} __rte_cache_aligned;
 
 void rx_enable_latency(void);
 
-void rx_thread_run_rx(int portid);
+bool rx_enable_hw_timestamp(uint16_t portid);
+
+void rx_enable_sw_timestamp(void);
+
+void rx_thread_run_rx(int portid, unsigned queue);
 
 #endif /* _PKTGEN_RX_H_ */
@@ -2,11 +2,15 @@
 #include "control.h"
 #include "stat.h"
 #include "rate.h"
+#include "trial.h"
+#include "pkt_seq.h"
+#include "writer.h"
 
 #include <rte_lcore.h>
 #include <rte_cycles.h>
 #include <rte_ring.h>
 #include <rte_malloc.h>
+#include <rte_random.h>
 
 static struct stat_ctl stat_ctl = {
 	.port_stat = {
@@ -22,11 +26,26 @@ static struct stat_ctl stat_ctl = {
 	.next_dump_cycle = 0,
 	.dump_interval = 0,
 	.is_latency = false,
-	.lat_output = NULL,
-	.lat_pages = NULL,
-	.free_pages = NULL,
-	.full_pages = NULL,
-	.cur_page = NULL,
+	.is_record = false,
+	.is_compact = false,
+	.lat_prealloc = 0,
+	.lat_page_num = STAT_LAT_PAGE_NUM,
+	.lat_page_max = STAT_LAT_PAGE_MAX,
+	.nb_lat_queue = 0,
+	.is_loss = false,
+	.lat_queue = {
+		{
+			.hist = NULL,
+			.nb_chunk = 0,
+			.free_pages = NULL,
+			.full_pages = NULL,
+			.cur_page = NULL,
+		}
+	},
+	.lat_window = {
+		.is_active = false,
+		.lat = {NULL, NULL},
+	},
 };
 
 bool stat_set_output(const char *prefix)
@@ -38,35 +57,108 @@ bool stat_set_output(const char *prefix)
 	else
 		snprintf(outputfile, FILEPATH_MAX, "%s", prefix);
 
-	stat_ctl.lat_output = fopen(outputfile, "w");
-	if (!stat_ctl.lat_output) {
+	if (!writer_open(&stat_ctl.lat_writer, outputfile)) {
 		LOG_ERROR("Failed to latency record file %s", outputfile);
 		return false;
 	}
 	stat_ctl.is_latency = true;
+	stat_ctl.is_record = true;
 	return true;
 }
 
-static void __update_stat(struct stat_info *stat, uint64_t byte)
+/* Latency histograms only, no raw record */
+void stat_enable_latency(void)
+{
+	stat_ctl.is_latency = true;
+}
+
+void stat_enable_compact(void)
 {
-	stat->stat_bytes += byte;
-	stat->stat_pkts ++;
+	stat_ctl.is_compact = true;
 }
 
-void stat_update_rx(uint64_t bytes)
+/* Format: <pages>[:<max pages>], latency pages of each RX queue at
+ * start and at most, STAT_LAT_PAGE_SIZE records each */
+bool stat_set_page_pool(const char *pages)
 {
-	__update_stat(&stat_ctl.port_stat[STAT_IDX_RX], bytes);
+	char *str = NULL, *max = NULL;
+	int num = 0, val = 0;
+	bool ret = false;
+
+	str = strdup(pages);
+	if (str == NULL)
+		return false;
+
+	max = strchr(str, ':');
+	if (max != NULL)
+		*max++ = '\0';
+
+	if (!str_to_int(str, 10, &num) || num < 2) {
+		LOG_ERROR("Wrong number of latency pages %s", pages);
+		goto out;
+	}
+	val = RTE_MAX(num, STAT_LAT_PAGE_MAX);
+	if (max != NULL && (!str_to_int(max, 10, &val) || val < num)) {
+		LOG_ERROR("Wrong max number of latency pages %s", pages);
+		goto out;
+	}
+	stat_ctl.lat_page_num = num;
+	stat_ctl.lat_page_max = val;
+	ret = true;
+
+out:
+	free(str);
+	return ret;
+}
+
+/* Size of the latency record file to preallocate, in MB */
+bool stat_set_prealloc(const char *mbytes)
+{
+	int val = 0;
+
+	if (!str_to_int(mbytes, 10, &val) || val <= 0) {
+		LOG_ERROR("Wrong size to preallocate %s", mbytes);
+		return false;
+	}
+	stat_ctl.lat_prealloc = (uint64_t)val << 20;
+	return true;
+}
+
+static inline void __update_counter(unsigned idx, unsigned queue,
+				uint64_t bytes, unsigned int pkts)
+{
+	struct stat_counter *cnt = &stat_ctl.counter[idx][queue];
+
+	cnt->bytes += bytes;
+	cnt->pkts += pkts;
 }
 
-void stat_update_rx_latency(uint64_t id, uint64_t tx, uint64_t rx)
+void stat_update_rx(unsigned queue, uint64_t bytes, unsigned int pkts)
 {
-	struct stat_ctl *ctl = &stat_ctl;
+	__update_counter(STAT_IDX_RX, queue, bytes, pkts);
+}
+
+void stat_update_rx_latency(unsigned queue,
+				uint64_t id, uint64_t tx, uint64_t rx)
+{
+	struct stat_lat_queue *ctl = &stat_ctl.lat_queue[queue];
 	void *tmp = NULL;
 
+	hist_add(ctl->hist, rx > tx ? rx - tx : 0);
+	if (likely(PKT_SEQ_LATENCY_QUEUE(id) < WORKER_QUEUE_MAX)) {
+		if (stat_ctl.is_loss)
+			loss_add(&ctl->loss[PKT_SEQ_LATENCY_QUEUE(id)],
+							PKT_SEQ_LATENCY_SEQ(id));
+		else
+			ctl->loss[PKT_SEQ_LATENCY_QUEUE(id)].nb_recv++;
+	}
+	if (!stat_ctl.is_record)
+		return;
+
+	/* out of pages, the stat thread reports the drops */
 	if (ctl->cur_page == NULL) {
 		if (rte_ring_dequeue(ctl->free_pages, &tmp) < 0) {
-			LOG_ERROR("No free pages, drop record(%lu, %lu, %lu).",
-						id, tx, rx);
+			ctl->nb_drop++;
 			return;
 		}
 		ctl->cur_page = (struct stat_lat_page *)tmp;
@@ -74,8 +166,7 @@ void stat_update_rx_latency(uint64_t id, uint64_t tx, uint64_t rx)
 	else if (ctl->cur_page->nb_record == STAT_LAT_PAGE_SIZE) {
 		rte_ring_enqueue(ctl->full_pages, ctl->cur_page);
 		if (rte_ring_dequeue(ctl->free_pages, &tmp) < 0) {
-			LOG_ERROR("No free pages, drop record(%lu, %lu, %lu).",
-						id, tx, rx);
+			ctl->nb_drop++;
 			ctl->cur_page = NULL;
 			return;
 		}
@@ -87,10 +178,38 @@ void stat_update_rx_latency(uint64_t id, uint64_t tx, uint64_t rx)
 	ctl->cur_page->nb_record ++;
 }
 
-void stat_update_tx(uint64_t bytes, unsigned int pkts)
+void stat_update_tx(unsigned queue, uint64_t bytes, unsigned int pkts)
+{
+	__update_counter(STAT_IDX_TX, queue, bytes, pkts);
+}
+
+/* Lock-free: every counter has a single writer and 64-bit loads are
+ * atomic, so a sum may only lag behind by the bursts in flight. */
+static void __sum_queue_stat(void)
+{
+	unsigned idx = 0, i = 0, nb_queue = 0;
+	struct stat_info *stat = NULL;
+
+	for (idx = 0; idx < STAT_IDX_MAX; idx++) {
+		stat = &stat_ctl.port_stat[idx];
+		nb_queue = ctl_get_nb_queue(idx == STAT_IDX_TX ?
+						WORKER_TX : WORKER_RX);
+
+		stat->stat_bytes = 0;
+		stat->stat_pkts = 0;
+		for (i = 0; i < nb_queue; i++) {
+			stat->stat_bytes += stat_ctl.counter[idx][i].bytes;
+			stat->stat_pkts += stat_ctl.counter[idx][i].pkts;
+		}
+	}
+}
+
+/* Totals of all queues, idx is STAT_IDX_RX or STAT_IDX_TX */
+void stat_get_total(unsigned idx, uint64_t *bytes, uint64_t *pkts)
 {
-	stat_ctl.port_stat[STAT_IDX_TX].stat_bytes += bytes;
-	stat_ctl.port_stat[STAT_IDX_TX].stat_pkts += pkts;
+	__sum_queue_stat();
+	*bytes = stat_ctl.port_stat[idx].stat_bytes;
+	*pkts = stat_ctl.port_stat[idx].stat_pkts;
 }
 
 static inline void __process_stat(struct stat_info *stat,
@@ -115,12 +234,99 @@ static inline void __process_stat(struct stat_info *stat,
 	*pps = (pkts - last_p) / (sec * 1000 * 1000);
 }
 
+/* Sum up the loss trackers of all streams seen by all RX queues. At
+ * the end of the run, the packets still missing in the windows are
+ * counted lost. */
+static void __sum_loss(struct loss_track *total, bool is_end)
+{
+	struct loss_track *loss = NULL;
+	unsigned i = 0, j = 0;
+
+	memset(total, 0, sizeof(struct loss_track));
+	for (i = 0; i < stat_ctl.nb_lat_queue; i++) {
+		for (j = 0; j < WORKER_QUEUE_MAX; j++) {
+			loss = &stat_ctl.lat_queue[i].loss[j];
+			if (is_end)
+				loss_flush(loss);
+			loss_merge(total, loss);
+		}
+	}
+}
+
+static void __print_loss(const struct loss_track *loss)
+{
+	LOG_INFO("Latency packets: lost %lu, reordered %lu (max distance %lu), "
+					"duplicated %lu, late %lu", loss->nb_lost,
+					loss->nb_reorder, loss->max_reorder, loss->nb_dup,
+					loss->nb_late);
+}
+
+/* Page pool usage of all RX queues. Every interval only the new drops
+ * are reported. */
+static void __print_lat_pool(bool is_end)
+{
+	struct stat_lat_queue *ctl = NULL;
+	uint64_t drop = 0, total = 0, new_drop = 0;
+	unsigned i = 0, nb_page = 0, max_used = 0;
+
+	for (i = 0; i < stat_ctl.nb_lat_queue; i++) {
+		ctl = &stat_ctl.lat_queue[i];
+		drop = ctl->nb_drop;
+		total += drop;
+		new_drop += drop - ctl->last_drop;
+		ctl->last_drop = drop;
+		nb_page += ctl->nb_page;
+		max_used += ctl->max_used;
+	}
+
+	if (is_end) {
+		LOG_INFO("\tLatency pages: %u, at most %u in use, %lu records dropped",
+						nb_page, max_used, total);
+	} else if (new_drop > 0) {
+		LOG_INFO("Out of latency pages, %lu records dropped", new_drop);
+	}
+}
+
+/* Merge the histograms of all RX queues into a summary in usec */
+static bool __summary_latency(struct stat_lat_summary *sum)
+{
+	double usec_per_cycle = 1e6 / stat_ctl.cycle_per_sec;
+	struct hist *hist = NULL;
+	unsigned i = 0;
+
+	memset(sum, 0, sizeof(struct stat_lat_summary));
+	hist = (struct hist *)malloc(sizeof(struct hist));
+	if (hist == NULL) {
+		LOG_ERROR("Failed to allocate latency histogram");
+		return false;
+	}
+	hist_reset(hist);
+	for (i = 0; i < stat_ctl.nb_lat_queue; i++)
+		hist_merge(hist, stat_ctl.lat_queue[i].hist);
+
+	sum->nb = hist->nb;
+	if (hist->nb > 0) {
+		sum->min = hist->min * usec_per_cycle;
+		sum->max = hist->max * usec_per_cycle;
+		sum->avg = (double)hist->sum / hist->nb * usec_per_cycle;
+		sum->p50 = hist_percentile(hist, 0.5) * usec_per_cycle;
+		sum->p99 = hist_percentile(hist, 0.99) * usec_per_cycle;
+		sum->p999 = hist_percentile(hist, 0.999) * usec_per_cycle;
+		sum->p9999 = hist_percentile(hist, 0.9999) * usec_per_cycle;
+	}
+	free(hist);
+	return true;
+}
+
 static void __summary_stat(uint64_t cycles)
 {
 	double sec = 0;
 	uint64_t rx_bytes, rx_pkts, tx_bytes, tx_pkts;
+	struct stat_lat_summary lat;
+	struct loss_track loss;
 
 	sec = (double)cycles / stat_ctl.cycle_per_sec;
+	__sum_queue_stat();
 	rx_bytes = stat_ctl.port_stat[STAT_IDX_RX].stat_bytes;
 	rx_pkts = stat_ctl.port_stat[STAT_IDX_RX].stat_pkts;
 	tx_bytes = stat_ctl.port_stat[STAT_IDX_TX].stat_bytes;
@@ -133,64 +339,444 @@ static void __summary_stat(uint64_t cycles)
 	LOG_INFO("\tTX %lu bytes (%lf kbps), %lu packets (%lf pps)",
 					tx_bytes, (tx_bytes * 8 / (sec * 1024)),
 					tx_pkts, (tx_pkts / sec));
+
+	if (stat_ctl.is_latency && __summary_latency(&lat)) {
+		LOG_INFO("\tLatency of %lu packets (us): min %.3f, avg %.3f, "
+						"p50 %.3f, p99 %.3f, p99.9 %.3f, p99.99 %.3f, max %.3f",
+						lat.nb, lat.min, lat.avg, lat.p50, lat.p99, lat.p999,
+						lat.p9999, lat.max);
+	}
+
+	if (stat_ctl.is_record)
+		__print_lat_pool(true);
+
+	if (stat_ctl.is_latency && !stat_ctl.is_loss) {
+		__sum_loss(&loss, false);
+		LOG_INFO("\tLatency packets: received %lu, loss and reordering "
+						"are not tracked with several RX queues", loss.nb_recv);
+	} else if (stat_ctl.is_latency) {
+		__sum_loss(&loss, true);
+		LOG_INFO("\tLatency packets: received %lu, lost %lu (%.6f%%), "
+						"duplicated %lu, late %lu", loss.nb_recv, loss.nb_lost,
+						loss.nb_lost * 100.0
+						/ RTE_MAX(loss.nb_recv + loss.nb_lost, 1UL),
+						loss.nb_dup, loss.nb_late);
+		LOG_INFO("\tReordered %lu, distance avg %.3f, max %lu",
+						loss.nb_reorder, (double)loss.sum_reorder
+						/ RTE_MAX(loss.nb_reorder, 1UL), loss.max_reorder);
+	}
 }
 
-static bool __init_latency(void)
+static void __free_lat_queue(struct stat_lat_queue *ctl)
 {
-	struct stat_ctl *ctl = &stat_ctl;
-	size_t size = sizeof(struct stat_lat_page) * STAT_LAT_PAGE_NUM;
-	struct rte_ring *ring = NULL;
+	if (ctl->hist) {
+		rte_free(ctl->hist);
+		ctl->hist = NULL;
+	}
+	if (ctl->loss) {
+		rte_free(ctl->loss);
+		ctl->loss = NULL;
+	}
+	if (ctl->free_pages) {
+		rte_ring_free(ctl->free_pages);
+		ctl->free_pages = NULL;
+	}
+	if (ctl->full_pages) {
+		rte_ring_free(ctl->full_pages);
+		ctl->full_pages = NULL;
+	}
+	while (ctl->nb_chunk > 0) {
+		rte_free(ctl->chunks[--ctl->nb_chunk]);
+		ctl->chunks[ctl->nb_chunk] = NULL;
+	}
+	ctl->nb_page = 0;
+	ctl->cur_page = NULL;
+}
+
+/* Add nb pages to the free pages of the queue, the rings are sized for
+ * max_page pages so enqueuing can't fail */
+static bool __grow_lat_queue(struct stat_lat_queue *ctl, unsigned nb)
+{
+	size_t size = sizeof(struct stat_lat_page) * nb;
+	struct stat_lat_page *pages = NULL;
 	unsigned i = 0;
 
-	ctl->lat_pages = (struct stat_lat_page *)rte_zmalloc(NULL, size, 0);
-	if (!ctl->lat_pages) {
+	if (ctl->nb_chunk == STAT_LAT_CHUNK_MAX)
+		return false;
+
+	pages = (struct stat_lat_page *)rte_zmalloc(NULL, size,
+					RTE_CACHE_LINE_SIZE);
+	if (!pages) {
 		LOG_ERROR("Failed to allocate latency record cache "
 					"(%lu bytes)", size);
 		return false;
 	}
+	ctl->chunks[ctl->nb_chunk++] = pages;
+	ctl->nb_page += nb;
+
+	for (i = 0; i < nb; i++)
+		rte_ring_enqueue(ctl->free_pages, &pages[i]);
+	return true;
+}
+
+static bool __init_lat_queue(struct stat_lat_queue *ctl, unsigned queue)
+{
+	struct rte_ring *ring = NULL;
+	void *tmp = NULL;
+	char name[RTE_RING_NAMESIZE];
+	unsigned i = 0;
+
+	ctl->hist = (struct hist *)rte_zmalloc(NULL, sizeof(struct hist),
+					RTE_CACHE_LINE_SIZE);
+	if (!ctl->hist) {
+		LOG_ERROR("Failed to allocate latency histogram");
+		return false;
+	}
+	hist_reset(ctl->hist);
+
+	ctl->loss = (struct loss_track *)rte_zmalloc(NULL,
+					sizeof(struct loss_track) * WORKER_QUEUE_MAX,
+					RTE_CACHE_LINE_SIZE);
+	if (!ctl->loss) {
+		LOG_ERROR("Failed to allocate loss trackers");
+		goto free_queue;
+	}
+	for (i = 0; i < WORKER_QUEUE_MAX; i++)
+		loss_reset(&ctl->loss[i]);
 
-	ring = rte_ring_create("LAT_PAGE_FULL", STAT_LAT_PAGE_NUM,
+	if (!stat_ctl.is_record)
+		return true;
+
+	ctl->max_page = stat_ctl.lat_page_max;
+	ctl->max_used = 0;
+	ctl->last_drop = 0;
+	ctl->nb_drop = 0;
+
+	snprintf(name, sizeof(name), "LAT_PAGE_FULL_%u", queue);
+	ring = rte_ring_create(name, ctl->max_page,
 							rte_socket_id(),
-							RING_F_SP_ENQ | RING_F_SC_DEQ);
+							RING_F_SP_ENQ | RING_F_SC_DEQ | RING_F_EXACT_SZ);
 	if (!ring) {
 		LOG_ERROR("Faile to create full_pages ring buffer");
-		goto free_lat_pages;
+		goto free_queue;
 	}
 	ctl->full_pages = ring;
 
-	ring = rte_ring_create("LAT_PAGE_FREE", STAT_LAT_PAGE_NUM,
+	snprintf(name, sizeof(name), "LAT_PAGE_FREE_%u", queue);
+	ring = rte_ring_create(name, ctl->max_page,
 							rte_socket_id(),
-							RING_F_SP_ENQ | RING_F_SC_DEQ);
+							RING_F_SP_ENQ | RING_F_SC_DEQ | RING_F_EXACT_SZ);
 	if (!ring) {
 		LOG_ERROR("Faile to create free_pages ring buffer");
-		goto free_full_pages;
+		goto free_queue;
 	}
 	ctl->free_pages = ring;
 
-	/* Insert all initial pages expect the first one into free_pages */
-	for (i = 1; i < STAT_LAT_PAGE_NUM; i++) {
-		if (rte_ring_enqueue(ctl->free_pages, &(ctl->lat_pages[i])) < 0) {
-			LOG_ERROR("Failed to enqueue free pages");
-			goto free_free_pages;
+	if (!__grow_lat_queue(ctl, stat_ctl.lat_page_num))
+		goto free_queue;
+	rte_ring_dequeue(ctl->free_pages, &tmp);
+	ctl->cur_page = (struct stat_lat_page *)tmp;
+
+	return true;
+
+free_queue:
+	__free_lat_queue(ctl);
+	return false;
+}
+
+/* Each RX queue gets its own page pool and rings, so that every ring
+ * keeps a single producer and a single consumer. */
+static bool __init_latency(void)
+{
+	unsigned i = 0;
+
+	stat_ctl.nb_lat_queue = ctl_get_nb_queue(WORKER_RX);
+	stat_ctl.is_loss = (stat_ctl.nb_lat_queue == 1);
+	for (i = 0; i < stat_ctl.nb_lat_queue; i++) {
+		if (!__init_lat_queue(&stat_ctl.lat_queue[i], i)) {
+			while (i > 0)
+				__free_lat_queue(&stat_ctl.lat_queue[--i]);
+			return false;
 		}
 	}
-	ctl->cur_page = &ctl->lat_pages[0];
+	return true;
+}
+
+static inline uint64_t __zigzag(uint64_t val)
+{
+	return (val << 1) ^ (uint64_t)((int64_t)val >> 63);
+}
+
+static inline uint8_t *__put_varint(uint8_t *p, uint64_t val)
+{
+	while (val >= 0x80) {
+		*p++ = (uint8_t)val | 0x80;
+		val >>= 7;
+	}
+	*p++ = (uint8_t)val;
+	return p;
+}
+
+static void __init_lat_enc(struct stat_lat_enc *enc)
+{
+	struct stat_lat_enc_hdr hdr;
+	unsigned i = 0;
+
+	for (i = 0; i < STAT_LAT_ENC_SLOTS; i++) {
+		enc->prev_id[i] = PKT_SEQ_LATENCY_ID(i, 0);
+		enc->prev_tx[i] = 0;
+	}
+
+	memcpy(hdr.magic, STAT_LAT_ENC_MAGIC, sizeof(hdr.magic));
+	hdr.cycle_per_sec = stat_ctl.cycle_per_sec;
+	writer_write(&stat_ctl.lat_writer, &hdr, sizeof(hdr));
+}
+
+/* A stream of records usually takes 4 to 6 bytes per record: ids of a
+ * TX queue grow by one, packets of a burst share their TX timestamp */
+static size_t __encode_lat_page(struct stat_lat_enc *enc,
+				struct stat_lat_page *page)
+{
+	struct stat_lat *rec = NULL;
+	uint8_t *p = enc->buf;
+	uint64_t slot = 0;
+	unsigned i = 0;
+
+	for (i = 0; i < page->nb_record; i++) {
+		rec = &page->record[i];
+		slot = PKT_SEQ_LATENCY_QUEUE(rec->pkt_id);
+		if (slot >= STAT_LAT_ENC_ESCAPE) {
+			slot = STAT_LAT_ENC_ESCAPE;
+			p = __put_varint(p, slot);
+			p = __put_varint(p, rec->pkt_id);
+		} else
+			p = __put_varint(p, __zigzag(rec->pkt_id - enc->prev_id[slot]) << 4
+							| slot);
+		p = __put_varint(p, __zigzag(rec->tx_ts - enc->prev_tx[slot]));
+		p = __put_varint(p, __zigzag(rec->rx_ts - rec->tx_ts));
+		enc->prev_id[slot] = rec->pkt_id;
+		enc->prev_tx[slot] = rec->tx_ts;
+	}
+	return p - enc->buf;
+}
+
+static void __write_lat_page(struct stat_lat_page *page)
+{
+	size_t len = 0;
+
+	if (stat_ctl.is_compact) {
+		len = __encode_lat_page(&stat_ctl.lat_enc, page);
+		writer_write(&stat_ctl.lat_writer, stat_ctl.lat_enc.buf, len);
+		return;
+	}
+	writer_write(&stat_ctl.lat_writer, page->record,
+				sizeof(struct stat_lat) * page->nb_record);
+}
+
+/* Reservoir sampling (algorithm R) in each half of the window */
+static void __collect_lat_page(struct stat_lat_window *win,
+				struct stat_lat_page *page)
+{
+	struct stat_lat *rec = NULL;
+	uint64_t lat = 0, idx = 0;
+	unsigned i = 0, half = 0;
+
+	for (i = 0; i < page->nb_record; i++) {
+		rec = &page->record[i];
+		if (((rec->pkt_id & PKT_SEQ_LATENCY_STEP_MASK)
+						>> PKT_SEQ_LATENCY_STEP_SHIFT) != win->step)
+			continue;
+		half = (rec->tx_ts >= win->mid_cycle);
+		lat = rec->rx_ts > rec->tx_ts ? rec->rx_ts - rec->tx_ts : 0;
+		win->nb_seen[half]++;
+		if (win->nb[half] < STAT_LAT_WINDOW_HALF) {
+			win->lat[half][win->nb[half]++] = lat;
+			continue;
+		}
+		idx = rte_rand_max(win->nb_seen[half]);
+		if (idx < STAT_LAT_WINDOW_HALF)
+			win->lat[half][idx] = lat;
+	}
+}
+
+/* Track the pages in use and grow the pool before it runs out */
+static void __update_lat_pool(struct stat_lat_queue *ctl)
+{
+	unsigned nb_free = rte_ring_count(ctl->free_pages);
+	unsigned used = ctl->nb_page - nb_free;
+
+	if (used > ctl->max_used)
+		ctl->max_used = used;
+
+	if (nb_free >= ctl->nb_page / STAT_LAT_PAGE_LOW_DIV
+					|| ctl->nb_page >= ctl->max_page)
+		return;
+
+	if (__grow_lat_queue(ctl, RTE_MIN(ctl->nb_page,
+						ctl->max_page - ctl->nb_page))) {
+		LOG_INFO("Latency pages of RX queue %u: %u",
+						(unsigned)(ctl - stat_ctl.lat_queue), ctl->nb_page);
+	} else {
+		/* stick to what we have */
+		ctl->max_page = ctl->nb_page;
+	}
+}
+
+/* Write back the full pages of all queues and give them back to RX */
+static void __flush_lat_pages(void)
+{
+	struct stat_lat_queue *ctl = NULL;
+	struct stat_lat_page *page = NULL;
+	void *tmp = NULL;
+	unsigned i = 0;
+
+	for (i = 0; i < stat_ctl.nb_lat_queue; i++) {
+		ctl = &stat_ctl.lat_queue[i];
+		while (rte_ring_dequeue(ctl->full_pages, &tmp) == 0) {
+			page = (struct stat_lat_page *)tmp;
+			__write_lat_page(page);
+			if (stat_ctl.lat_window.is_active)
+				__collect_lat_page(&stat_ctl.lat_window, page);
+			page->nb_record = 0;
+			rte_ring_enqueue(ctl->free_pages, page);
+		}
+		__update_lat_pool(ctl);
+	}
+}
+
+static uint64_t __lat_rx_drop(void)
+{
+	uint64_t drop = 0;
+	unsigned i = 0;
 
+	for (i = 0; i < stat_ctl.nb_lat_queue; i++)
+		drop += stat_ctl.lat_queue[i].nb_drop;
+	return drop;
+}
+
+/* Start collecting the latencies of the packets tagged with step,
+ * which are sent from start_cycle to stop_cycle */
+bool stat_lat_window_begin(unsigned step,
+				uint64_t start_cycle, uint64_t stop_cycle)
+{
+	struct stat_lat_window *win = &stat_ctl.lat_window;
+	unsigned half = 0;
+
+	if (!stat_ctl.is_record)
+		return false;
+
+	for (half = 0; half < 2; half++) {
+		if (win->lat[half] != NULL)
+			continue;
+		win->lat[half] = (uint64_t *)malloc(sizeof(uint64_t)
+						* STAT_LAT_WINDOW_HALF);
+		if (win->lat[half] == NULL) {
+			LOG_ERROR("Failed to allocate latency window");
+			return false;
+		}
+	}
+
+	win->step = step;
+	win->mid_cycle = start_cycle + (stop_cycle - start_cycle) / 2;
+	for (half = 0; half < 2; half++) {
+		win->nb[half] = 0;
+		win->nb_seen[half] = 0;
+	}
+	win->rx_drop = __lat_rx_drop();
+	win->is_active = true;
 	return true;
+}
+
+static int __cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
 
-free_free_pages:
-	rte_ring_free(ctl->free_pages);
-	ctl->free_pages = NULL;
+	return (x > y) - (x < y);
+}
 
-free_full_pages:
-	rte_ring_free(ctl->full_pages);
-	ctl->full_pages = NULL;
+static inline uint64_t __half_median(const struct stat_lat_window *win,
+				unsigned half)
+{
+	return win->lat[half][(win->nb[half] - 1) / 2];
+}
 
-free_lat_pages:
-	rte_free(ctl->lat_pages);
-	ctl->lat_pages = NULL;
+/* Percentiles of the whole window from the two sorted halves, each
+ * sample standing for nb_seen / nb records of its half */
+static void __window_pct(const struct stat_lat_window *win,
+				const double *q, double *pct, unsigned nb_q)
+{
+	double weight[2], total = 0, cum = 0;
+	uint64_t idx[2] = {0, 0}, lat = 0;
+	unsigned half = 0, k = 0;
 
-	return false;
+	for (half = 0; half < 2; half++) {
+		weight[half] = (double)win->nb_seen[half] / win->nb[half];
+		total += win->nb_seen[half];
+	}
+
+	while (k < nb_q && (idx[0] < win->nb[0] || idx[1] < win->nb[1])) {
+		half = (idx[1] == win->nb[1] || (idx[0] < win->nb[0]
+					&& win->lat[0][idx[0]] <= win->lat[1][idx[1]])) ? 0 : 1;
+		lat = win->lat[half][idx[half]++];
+		cum += weight[half];
+		while (k < nb_q && cum >= q[k] * total)
+			pct[k++] = lat;
+	}
+	for (; k < nb_q; k++)
+		pct[k] = lat;
+}
+
+/* Stop collecting and summarize the window. Records still in the
+ * pages being filled by RX are not part of it. */
+bool stat_lat_window_end(struct stat_lat_summary *sum)
+{
+	static const double q[] = {0.5, 0.99, 0.999, 0.9999};
+	struct stat_lat_window *win = &stat_ctl.lat_window;
+	double usec_per_cycle = 1e6 / stat_ctl.cycle_per_sec;
+	double pct[RTE_DIM(q)], total = 0, half_sum = 0;
+	uint64_t rx_drop = 0, i = 0;
+	unsigned half = 0;
+
+	__flush_lat_pages();
+	win->is_active = false;
+
+	memset(sum, 0, sizeof(struct stat_lat_summary));
+	sum->nb = win->nb_seen[0] + win->nb_seen[1];
+	rx_drop = __lat_rx_drop() - win->rx_drop;
+	if (rx_drop) {
+		LOG_INFO("%lu latency records dropped by RX, no summary", rx_drop);
+		return false;
+	}
+	if (win->nb[0] == 0 || win->nb[1] == 0) {
+		LOG_INFO("No latency record in the %s half, no summary",
+						win->nb[0] == 0 ? "first" : "second");
+		return false;
+	}
+	if (win->nb_seen[0] > win->nb[0] || win->nb_seen[1] > win->nb[1])
+		LOG_INFO("Latency summary of %lu + %lu samples of %lu records",
+						win->nb[0], win->nb[1], sum->nb);
+
+	for (half = 0; half < 2; half++) {
+		qsort(win->lat[half], win->nb[half], sizeof(uint64_t), __cmp_u64);
+		half_sum = 0;
+		for (i = 0; i < win->nb[half]; i++)
+			half_sum += win->lat[half][i];
+		total += half_sum * win->nb_seen[half] / win->nb[half];
+	}
+	__window_pct(win, q, pct, RTE_DIM(q));
+
+	sum->is_valid = true;
+	sum->min = RTE_MIN(win->lat[0][0], win->lat[1][0]) * usec_per_cycle;
+	sum->max = RTE_MAX(win->lat[0][win->nb[0] - 1],
+					win->lat[1][win->nb[1] - 1]) * usec_per_cycle;
+	sum->avg = total / sum->nb * usec_per_cycle;
+	sum->p50 = pct[0] * usec_per_cycle;
+	sum->p99 = pct[1] * usec_per_cycle;
+	sum->p999 = pct[2] * usec_per_cycle;
+	sum->p9999 = pct[3] * usec_per_cycle;
+	sum->p50_first = __half_median(win, 0) * usec_per_cycle;
+	sum->p50_last = __half_median(win, 1) * usec_per_cycle;
+	return true;
 }
 
 bool stat_init(void)
@@ -203,17 +789,19 @@ bool stat_init(void)
 		ret = __init_latency();
 		if (!ret) {
 			LOG_ERROR("Failed to init latency stat");
-			if (stat_ctl.lat_output) {
-				fclose(stat_ctl.lat_output);
-				stat_ctl.lat_output = NULL;
-			}
-			ctl_set_state(WORKER_STAT, STATE_ERROR);
+			if (stat_ctl.is_record)
+				writer_close(&stat_ctl.lat_writer);
+			ctl_set_state(WORKER_STAT, 0, STATE_ERROR);
 			return false;
 		}
 	}
 
 	/* Initialize timer */
 	stat_ctl.cycle_per_sec = rte_get_tsc_hz();
+	if (stat_ctl.is_record && stat_ctl.lat_prealloc > 0)
+		writer_prealloc(&stat_ctl.lat_writer, stat_ctl.lat_prealloc);
+	if (stat_ctl.is_record && stat_ctl.is_compact)
+		__init_lat_enc(&stat_ctl.lat_enc);
 	stat_ctl.dump_interval = STAT_PRINT_SEC * stat_ctl.cycle_per_sec;
 	cycle = rte_get_tsc_cycles();
 	for (i = 0; i < STAT_IDX_MAX; i++) {
@@ -221,7 +809,7 @@ bool stat_init(void)
 	}
 	stat_ctl.next_dump_cycle = cycle + stat_ctl.dump_interval;
 
-	ctl_set_state(WORKER_STAT, STATE_INITED);
+	ctl_set_state(WORKER_STAT, 0, STATE_INITED);
 	return true;
 }
 
@@ -251,6 +839,7 @@ uint64_t stat_processing(void)
 		return stat_ctl.next_dump_cycle;
 	}
 
+	__sum_queue_stat();
 	for (i = 0; i < STAT_IDX_MAX; i++) {
 		__process_stat(&stat_ctl.port_stat[i], cur_cycle,
 							&bps[i], &pps[i]);
@@ -260,6 +849,14 @@ uint64_t stat_processing(void)
 					bps[STAT_IDX_TX], pps[STAT_IDX_TX]);
 	LOG_INFO("RX speed %lf mbps, %lf kpps",
 					bps[STAT_IDX_RX], pps[STAT_IDX_RX]);
+	if (stat_ctl.is_latency && stat_ctl.is_loss) {
+		struct loss_track loss;
+
+		__sum_loss(&loss, false);
+		__print_loss(&loss);
+	}
+	if (stat_ctl.is_record)
+		__print_lat_pool(false);
 
 	stat_ctl.next_dump_cycle = cur_cycle + stat_ctl.dump_interval;
 	return stat_ctl.next_dump_cycle;
@@ -270,81 +867,82 @@ void stat_finish(uint64_t start_cycle)
 	__summary_stat(rte_get_tsc_cycles() - start_cycle);
 
 	if (stat_ctl.is_latency) {
-		if (stat_ctl.free_pages) {
-			rte_ring_free(stat_ctl.free_pages);
-			stat_ctl.free_pages = NULL;
-		}
-		if (stat_ctl.full_pages) {			
-			unsigned pages = rte_ring_count(stat_ctl.full_pages);
+		struct stat_lat_queue *ctl = NULL;
+		unsigned i = 0, pages = 0;
+
+		for (i = 0; i < stat_ctl.nb_lat_queue; i++) {
+			ctl = &stat_ctl.lat_queue[i];
+			if (!stat_ctl.is_record) {
+				__free_lat_queue(ctl);
+				continue;
+			}
 
+			pages = rte_ring_count(ctl->full_pages);
 			if (pages > 0) {
-				LOG_INFO("Write back the %u pages in the queue", pages);
+				LOG_INFO("Write back the %u pages in queue %u", pages, i);
 				struct stat_lat_page *page = NULL;
 				void *tmp = NULL;
 
-				while (rte_ring_dequeue(stat_ctl.full_pages, &tmp) == 0) {
+				while (rte_ring_dequeue(ctl->full_pages, &tmp) == 0) {
 					page = (struct stat_lat_page *)tmp;
-					fwrite(page->record, sizeof(struct stat_lat),
-							page->nb_record, stat_ctl.lat_output);
+					__write_lat_page(page);
 				}
 			}
 
-			rte_ring_free(stat_ctl.full_pages);
-			stat_ctl.full_pages = NULL;
-		}
-		if (stat_ctl.cur_page) {
-			LOG_INFO("Write back the last %u records",
-						stat_ctl.cur_page->nb_record);
-			fwrite(stat_ctl.cur_page->record, sizeof(struct stat_lat),
-					stat_ctl.cur_page->nb_record, stat_ctl.lat_output);
-			stat_ctl.cur_page = NULL;
-		}
+			if (ctl->cur_page) {
+				LOG_INFO("Write back the last %u records of queue %u",
+							ctl->cur_page->nb_record, i);
+				__write_lat_page(ctl->cur_page);
+			}
 
-		if (stat_ctl.lat_pages) {
-			rte_free(stat_ctl.lat_pages);
-			stat_ctl.lat_pages = NULL;
+			__free_lat_queue(ctl);
 		}
 
-		if (stat_ctl.lat_output) {
-			fclose(stat_ctl.lat_output);
-			stat_ctl.lat_output = NULL;
-		}
+		if (stat_ctl.is_record)
+			writer_close(&stat_ctl.lat_writer);
 	}
 
-	ctl_set_state(WORKER_STAT, STATE_STOPPED);
+	ctl_set_state(WORKER_STAT, 0, STATE_STOPPED);
+}
+
+/* One round of the stat thread: print the speeds every interval and
+ * write back the latency records, or sleep until the next interval
+ * but not beyond until */
+void stat_poll(uint64_t until)
+{
+	uint64_t next_cyc = stat_processing();
+
+	if (stat_ctl.is_record) {
+		__flush_lat_pages();
+		writer_poll(&stat_ctl.lat_writer);
+	}
+	else {
+		rate_wait_for_time(RTE_MIN(next_cyc, until));
+	}
 }
 
 void stat_thread_run(void)
 {
 	if (!stat_init()) {
 		LOG_ERROR("Failed to initialize stat thread");
-		ctl_set_state(WORKER_STAT, STATE_ERROR);
+		ctl_set_state(WORKER_STAT, 0, STATE_ERROR);
 		return;
 	}
 
-	uint64_t start_cyc = 0, next_cyc = 0;
+	uint64_t start_cyc = 0;
 
 	start_cyc = rte_get_tsc_cycles();
 
 	LOG_INFO("Stat thread is running...");
+
+	/* trials drive the test, it ends with them */
+	if (trial_is_enabled()) {
+		trial_thread_run();
+		ctl_quit();
+	}
+
 	while (!stat_is_stop()) {
-		next_cyc = stat_processing();
-
-		if (stat_ctl.is_latency) {
-			void *tmp = NULL;
-			struct stat_lat_page *page = NULL;
-
-			while (rte_ring_dequeue(stat_ctl.full_pages, &tmp) == 0) {
-				page = (struct stat_lat_page *)tmp;
-				fwrite(page->record, sizeof(struct stat_lat),
-							page->nb_record, stat_ctl.lat_output);
-				page->nb_record = 0;
-				rte_ring_enqueue(stat_ctl.free_pages, page);
-			}
-		}
-		else {
-			rate_wait_for_time(next_cyc);
-		}
+		stat_poll(UINT64_MAX);
 	}
 
 	stat_finish(start_cyc);
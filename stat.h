@@ -3,6 +3,21 @@
 
 #include <stdint.h>
 
+#include <rte_common.h>
+
+#include "control.h"
+#include "hist.h"
+#include "loss.h"
+#include "writer.h"
+
+/* Counters of one TX/RX worker. Each block is written by its own worker
+ * only and takes a whole cache line, the stat thread just reads them. */
+struct stat_counter {
+	uint64_t bytes;
+	uint64_t pkts;
+} __rte_cache_aligned;
+
+/* Owned by the stat thread */
 struct stat_info {
 	uint64_t last_bytes;
 	uint64_t last_pkts;
@@ -24,17 +39,109 @@ struct stat_lat {
 	uint64_t rx_ts;
 };
 
+/* Each RX queue starts with lat_page_num pages, allocated from the
+ * hugepage memory, and the stat thread adds chunks of as many pages as
+ * the pool has when less than a STAT_LAT_PAGE_LOW_DIV-th of them is
+ * free, up to lat_page_max pages */
 #define STAT_LAT_PAGE_SIZE 1024
 #define STAT_LAT_PAGE_NUM 128
+#define STAT_LAT_PAGE_MAX 4096
+#define STAT_LAT_PAGE_LOW_DIV 4
+#define STAT_LAT_CHUNK_MAX 32
 
 struct stat_lat_page {
 	struct stat_lat record[STAT_LAT_PAGE_SIZE];
 	uint16_t nb_record;
 };
 
+/* Compact records: a file header, then per record
+ *   varint(zigzag(id - prev id) << 4 | slot)
+ *   [varint(id) if slot is STAT_LAT_ENC_ESCAPE]
+ *   varint(zigzag(tx_ts - prev tx_ts))
+ *   varint(zigzag(rx_ts - tx_ts))
+ * where slot is the TX queue of the id and prev the previous record of
+ * that slot. Ids of a slot start at PKT_SEQ_LATENCY_ID(slot, 0). */
+#define STAT_LAT_ENC_MAGIC "PKTLATZ1"
+#define STAT_LAT_ENC_SLOTS 16
+#define STAT_LAT_ENC_ESCAPE (STAT_LAT_ENC_SLOTS - 1)
+/* slot varint, escaped id and two timestamps */
+#define STAT_LAT_ENC_MAX (1 + 10 * 3)
+
+struct stat_lat_enc_hdr {
+	char magic[8];
+	uint64_t cycle_per_sec;
+} __attribute__((__packed__));
+
+struct stat_lat_enc {
+	uint64_t prev_id[STAT_LAT_ENC_SLOTS];
+	uint64_t prev_tx[STAT_LAT_ENC_SLOTS];
+	uint8_t buf[STAT_LAT_PAGE_SIZE * STAT_LAT_ENC_MAX];
+};
+
 struct rte_ring;
 
+/* Latency histogram, loss trackers of the streams of each TX queue and
+ * page pool of one RX queue. The pages are only used when the raw
+ * records are kept. */
+struct stat_lat_queue {
+	struct hist *hist;
+	struct loss_track *loss;
+	struct rte_ring *free_pages;
+	struct rte_ring *full_pages;
+	/* used by stat thread */
+	struct stat_lat_page *chunks[STAT_LAT_CHUNK_MAX];
+	unsigned nb_chunk;
+	unsigned nb_page;
+	unsigned max_page;
+	/* high-water mark of the pages in use */
+	unsigned max_used;
+	uint64_t last_drop;
+	/* used by rx thread */
+	struct stat_lat_page *cur_page __rte_cache_aligned;
+	uint64_t nb_drop;
+} __rte_cache_aligned;
+
+/* Latencies of a window of time (e.g. a trial), taken from the records
+ * of the packets tagged with its step (see PKT_SEQ_LATENCY_SET_STEP()).
+ * The packets sent in the first and the second half of the window are
+ * kept apart, each half in a uniform sample (reservoir) of up to
+ * STAT_LAT_WINDOW_HALF latencies, whatever the rate and duration. */
+#define STAT_LAT_WINDOW_HALF (1 << 22)
+
+struct stat_lat_window {
+	bool is_active;
+	unsigned step;
+	uint64_t mid_cycle;
+	uint64_t *lat[2];
+	/* latencies kept and records seen per half */
+	uint64_t nb[2];
+	uint64_t nb_seen[2];
+	/* records RX had no page for, when the window began */
+	uint64_t rx_drop;
+};
+
+/* Latency summary, in usec. Not valid when a half of the window got no
+ * record, or when RX dropped records during it, the sample being
+ * biased then. */
+struct stat_lat_summary {
+	bool is_valid;
+	uint64_t nb;
+	double min;
+	double avg;
+	double p50;
+	double p99;
+	double p999;
+	double p9999;
+	double max;
+	/* medians of the packets sent in the first and the second half */
+	double p50_first;
+	double p50_last;
+};
+
 struct stat_ctl {
+	/* written by each TX/RX queue, summed up into port_stat */
+	struct stat_counter counter[STAT_IDX_MAX][WORKER_QUEUE_MAX];
+
 	struct stat_info port_stat[STAT_IDX_MAX];
 
 	uint64_t cycle_per_sec;
@@ -42,12 +149,22 @@ struct stat_ctl {
 	uint64_t dump_interval;
 
 	bool is_latency;
-	FILE *lat_output;
-	struct stat_lat_page *lat_pages;
-	struct rte_ring *free_pages;
-	struct rte_ring *full_pages;
-	/* used by rx thread */
-	struct stat_lat_page *cur_page;
+	/* raw records written to lat_writer, delta encoded if is_compact,
+	 * into a file of lat_prealloc bytes preallocated if not 0 */
+	bool is_record;
+	bool is_compact;
+	struct stat_lat_enc lat_enc;
+	struct writer lat_writer;
+	uint64_t lat_prealloc;
+	unsigned lat_page_num;
+	unsigned lat_page_max;
+	unsigned nb_lat_queue;
+	/* RSS spreads every TX stream over the RX queues, whose trackers
+	 * would each see gaps: with several RX queues, only the received
+	 * packets are counted */
+	bool is_loss;
+	struct stat_lat_queue lat_queue[WORKER_QUEUE_MAX];
+	struct stat_lat_window lat_window;
 };
 
 #define STAT_PRINT_SEC	1
@@ -60,14 +177,32 @@ uint64_t stat_processing(void);
 
 void stat_finish(uint64_t start_cycle);
 
-void stat_update_rx(uint64_t bytes);
+void stat_update_rx(unsigned queue, uint64_t bytes, unsigned int pkts);
 
-void stat_update_rx_latency(uint64_t id, uint64_t tx, uint64_t rx);
+void stat_update_rx_latency(unsigned queue,
+				uint64_t id, uint64_t tx, uint64_t rx);
 
-void stat_update_tx(uint64_t bytes, unsigned int pkts);
+void stat_update_tx(unsigned queue, uint64_t bytes, unsigned int pkts);
 
 bool stat_set_output(const char *prefix);
 
+void stat_enable_latency(void);
+
+void stat_enable_compact(void);
+
+bool stat_set_prealloc(const char *mbytes);
+
+bool stat_set_page_pool(const char *pages);
+
+void stat_get_total(unsigned idx, uint64_t *bytes, uint64_t *pkts);
+
+void stat_poll(uint64_t until);
+
+bool stat_lat_window_begin(unsigned step,
+				uint64_t start_cycle, uint64_t stop_cycle);
+
+bool stat_lat_window_end(struct stat_lat_summary *sum);
+
 void stat_thread_run(void);
 
 #endif /* _PKTGEN_STAT_H_ */
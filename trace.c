@@ -0,0 +1,304 @@
+#include "util.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <rte_common.h>
+#include <rte_memcpy.h>
+#include <rte_malloc.h>
+
+/* the record layout written by trace_convert.py */
+_Static_assert(sizeof(struct pkt_seq_info) == 16
+				&& offsetof(struct pkt_seq_info, proto) == 8
+				&& offsetof(struct pkt_seq_info, src_port) == 10
+				&& offsetof(struct pkt_seq_info, pkt_len) == 14,
+				"binary trace records don't match struct pkt_seq_info");
+
+/* Text traces grow heap arrays, moved to hugepages once read */
+#define TRACE_TEXT_INIT 4096
+
+/* Columns of the text traces, see trace.h */
+enum {
+	TRACE_COL_SRC_IP = 0,
+	TRACE_COL_DST_IP,
+	TRACE_COL_SRC_PORT,
+	TRACE_COL_DST_PORT,
+	TRACE_COL_PROTO,
+	TRACE_COL_MIN,
+};
+
+struct trace_schema {
+	/* column of the frame size and weight, -1 if none */
+	int len;
+	int weight;
+	unsigned nb_col;
+};
+
+static void *__to_hugepages(const char *type, const void *src, size_t size)
+{
+	void *dst = rte_malloc(type, size, RTE_CACHE_LINE_SIZE);
+
+	if (!dst) {
+		LOG_ERROR("Not enough hugepage memory for the trace (%lu bytes)",
+						size);
+		return NULL;
+	}
+	rte_memcpy(dst, src, size);
+	return dst;
+}
+
+/* Locate the len and weight columns in the names of a "#" line */
+static void __parse_schema(char *line, struct trace_schema *schema)
+{
+	char *name = NULL, *save = NULL;
+	int col = 0;
+
+	for (name = strtok_r(line + 1, " \t\r\n", &save); name;
+					name = strtok_r(NULL, " \t\r\n", &save), col++) {
+		if (strcmp(name, TRACE_COL_LEN) == 0)
+			schema->len = col;
+		else if (strcmp(name, TRACE_COL_WEIGHT) == 0)
+			schema->weight = col;
+	}
+	schema->nb_col = RTE_MAX(RTE_MAX(schema->len, schema->weight) + 1,
+					TRACE_COL_MIN);
+	LOG_INFO("Trace columns: frame size %d, weight %d", schema->len,
+					schema->weight);
+}
+
+/* Split a line into numbers, returns the number of columns or -1 */
+static int __parse_cols(char *line, unsigned long *cols)
+{
+	char *tok = NULL, *save = NULL, *end = NULL;
+	int nb = 0;
+
+	for (tok = strtok_r(line, " \t\r\n", &save);
+					tok && nb < TRACE_TEXT_COLS_MAX;
+					tok = strtok_r(NULL, " \t\r\n", &save)) {
+		errno = 0;
+		cols[nb++] = strtoul(tok, &end, 10);
+		if (errno != 0 || *end != '\0')
+			return -1;
+	}
+	return nb;
+}
+
+/* Double the capacity of the text arrays */
+static bool __grow_text(struct trace *trace, unsigned *max)
+{
+	unsigned nb = *max ? *max * 2 : TRACE_TEXT_INIT;
+	void *tmp = NULL;
+
+	tmp = realloc(trace->flows, sizeof(struct pkt_seq_info) * nb);
+	if (!tmp)
+		return false;
+	trace->flows = tmp;
+
+	tmp = realloc(trace->weights, sizeof(uint32_t) * nb);
+	if (!tmp)
+		return false;
+	trace->weights = tmp;
+
+	*max = nb;
+	return true;
+}
+
+static bool __parse_flow(const unsigned long *cols, int nb_col,
+				const struct trace_schema *schema, uint16_t pkt_len,
+				struct pkt_seq_info *flow, uint32_t *weight)
+{
+	if (nb_col < (int)schema->nb_col)
+		return false;
+
+	flow->src_ip = cols[TRACE_COL_SRC_IP];
+	flow->dst_ip = cols[TRACE_COL_DST_IP];
+	flow->src_port = cols[TRACE_COL_SRC_PORT];
+	flow->dst_port = cols[TRACE_COL_DST_PORT];
+	flow->proto = cols[TRACE_COL_PROTO];
+	flow->pkt_len = (schema->len >= 0) ? cols[schema->len] : pkt_len;
+	*weight = (schema->weight >= 0) ? cols[schema->weight] : 1;
+
+	return cols[TRACE_COL_SRC_IP] <= UINT32_MAX
+			&& cols[TRACE_COL_DST_IP] <= UINT32_MAX
+			&& cols[TRACE_COL_SRC_PORT] <= UINT16_MAX
+			&& cols[TRACE_COL_DST_PORT] <= UINT16_MAX
+			&& cols[TRACE_COL_PROTO] <= UINT8_MAX
+			&& (schema->len < 0 || cols[schema->len] <= UINT16_MAX)
+			&& (schema->weight < 0 || (cols[schema->weight] > 0
+					&& cols[schema->weight] <= UINT32_MAX));
+}
+
+static bool __load_text(FILE *fp, uint16_t pkt_len, struct trace *trace)
+{
+	struct trace_schema schema = {
+		.len = -1,
+		.weight = -1,
+		.nb_col = TRACE_COL_MIN,
+	};
+	struct trace text = {
+		.flows = NULL,
+		.weights = NULL,
+		.nb_flow = 0,
+	};
+	unsigned long cols[TRACE_TEXT_COLS_MAX];
+	char *line = NULL;
+	size_t line_size = 0;
+	unsigned max = 0, nb_line = 0;
+	int nb_col = 0;
+	bool ret = false;
+
+	while (getline(&line, &line_size, fp) >= 0) {
+		nb_line++;
+		if (line[0] == '#') {
+			if (text.nb_flow == 0)
+				__parse_schema(line, &schema);
+			continue;
+		}
+
+		nb_col = __parse_cols(line, cols);
+		if (nb_col == 0)
+			continue;
+
+		if (text.nb_flow == max && !__grow_text(&text, &max)) {
+			LOG_ERROR("Failed to allocate %u flows", max * 2);
+			goto free_text;
+		}
+
+		if (nb_col < 0 || !__parse_flow(cols, nb_col, &schema, pkt_len,
+						&text.flows[text.nb_flow],
+						&text.weights[text.nb_flow])) {
+			LOG_ERROR("Failed to read tuples[%u], line %u",
+							text.nb_flow, nb_line);
+			break;
+		}
+		text.nb_flow++;
+	}
+
+	if (text.nb_flow == 0) {
+		LOG_ERROR("No trace are found");
+		goto free_text;
+	}
+
+	trace->nb_flow = text.nb_flow;
+	trace->weights = NULL;
+	trace->flows = __to_hugepages("TX_TRACE", text.flows,
+					sizeof(struct pkt_seq_info) * text.nb_flow);
+	if (!trace->flows)
+		goto free_text;
+	if (schema.weight >= 0) {
+		trace->weights = __to_hugepages("TX_TRACE_WEIGHT", text.weights,
+						sizeof(uint32_t) * text.nb_flow);
+		if (!trace->weights)
+			goto free_text;
+	}
+	ret = true;
+
+free_text:
+	free(line);
+	free(text.flows);
+	free(text.weights);
+	return ret;
+}
+
+/* The file is mapped and copied at once, no parsing */
+static bool __load_binary(int fd, uint16_t pkt_len, struct trace *trace)
+{
+	const struct trace_hdr *hdr = NULL;
+	const uint8_t *recs = NULL;
+	struct stat st;
+	void *map = NULL;
+	uint64_t i = 0, size = 0;
+	bool ret = false;
+
+	if (fstat(fd, &st) < 0) {
+		LOG_ERROR("Failed to stat the trace, %s", strerror(errno));
+		return false;
+	}
+
+	if ((size_t)st.st_size < sizeof(struct trace_hdr)) {
+		LOG_ERROR("Trace header is truncated");
+		return false;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+					fd, 0);
+	if (map == MAP_FAILED) {
+		LOG_ERROR("Failed to map the trace, %s", strerror(errno));
+		return false;
+	}
+
+	hdr = (const struct trace_hdr *)map;
+	recs = (const uint8_t *)(hdr + 1);
+	if (hdr->rec_size != sizeof(struct pkt_seq_info)) {
+		LOG_ERROR("Unsupported trace record size %u", hdr->rec_size);
+		goto unmap;
+	}
+
+	size = hdr->nb_flow * hdr->rec_size;
+	if (hdr->flags & TRACE_F_WEIGHT)
+		size += hdr->nb_flow * sizeof(uint32_t);
+	if (hdr->nb_flow == 0 || hdr->nb_flow > UINT_MAX
+					|| (uint64_t)st.st_size - sizeof(struct trace_hdr) < size) {
+		LOG_ERROR("Trace of %lu flows is truncated or too large",
+						hdr->nb_flow);
+		goto unmap;
+	}
+
+	trace->nb_flow = hdr->nb_flow;
+	trace->weights = NULL;
+	trace->flows = __to_hugepages("TX_TRACE", recs,
+					hdr->nb_flow * hdr->rec_size);
+	if (!trace->flows)
+		goto unmap;
+
+	if (hdr->flags & TRACE_F_WEIGHT) {
+		trace->weights = __to_hugepages("TX_TRACE_WEIGHT",
+						recs + hdr->nb_flow * hdr->rec_size,
+						hdr->nb_flow * sizeof(uint32_t));
+		if (!trace->weights)
+			goto unmap;
+		for (i = 0; i < hdr->nb_flow; i++) {
+			if (trace->weights[i] == 0) {
+				LOG_ERROR("Flow %lu has a null weight", i);
+				goto unmap;
+			}
+		}
+	}
+
+	if (!(hdr->flags & TRACE_F_LEN)) {
+		for (i = 0; i < hdr->nb_flow; i++)
+			trace->flows[i].pkt_len = pkt_len;
+	}
+	ret = true;
+
+unmap:
+	munmap(map, st.st_size);
+	return ret;
+}
+
+bool trace_load(const char *filename, uint16_t pkt_len, struct trace *trace)
+{
+	char magic[TRACE_MAGIC_LEN];
+	FILE *fp = fopen(filename, "r");
+	bool ret = false;
+
+	if (!fp) {
+		LOG_ERROR("Failed to open trace file %s", filename);
+		return false;
+	}
+
+	if (fread(magic, TRACE_MAGIC_LEN, 1, fp) == 1
+					&& memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0) {
+		ret = __load_binary(fileno(fp), pkt_len, trace);
+	} else {
+		rewind(fp);
+		ret = __load_text(fp, pkt_len, trace);
+	}
+	fclose(fp);
+
+	if (ret)
+		LOG_INFO("Load %u traces%s", trace->nb_flow,
+						trace->weights ? ", weighted" : "");
+	return ret;
+}
@@ -0,0 +1,49 @@
+#ifndef _PKTGEN_TRACE_H_
+#define _PKTGEN_TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pkt_seq.h"
+
+/* 5-tuple traces, in text (one flow per line, see data/acl2_1k_trace)
+ * or in binary, told apart by the magic. A binary trace is a header
+ * followed by nb_flow records laid out as struct pkt_seq_info on x86,
+ * so that loading is a copy, then by nb_flow uint32_t weights if
+ * TRACE_F_WEIGHT. trace_convert.py writes them from the text ones. */
+#define TRACE_MAGIC "PKTTRCB1"
+#define TRACE_MAGIC_LEN 8
+/* records carry their frame size, else the default one is used */
+#define TRACE_F_LEN 0x1
+/* per-flow weights follow the records, else all flows weigh 1 */
+#define TRACE_F_WEIGHT 0x2
+
+struct trace_hdr {
+	char magic[TRACE_MAGIC_LEN];
+	uint32_t rec_size;
+	uint32_t flags;
+	uint64_t nb_flow;
+};
+
+/* Text traces have the columns src_ip dst_ip src_port dst_port proto,
+ * and may have more. A first line such as
+ *   # src_ip dst_ip src_port dst_port proto len weight
+ * names them, the "len" and "weight" columns give the frame size and
+ * the weight of each flow. The other extra columns are ignored. */
+#define TRACE_TEXT_COLS_MAX 16
+#define TRACE_COL_LEN "len"
+#define TRACE_COL_WEIGHT "weight"
+
+struct trace {
+	struct pkt_seq_info *flows;
+	/* a flow gets a share of the packets proportional to its weight,
+	 * NULL if all flows weigh the same */
+	uint32_t *weights;
+	unsigned nb_flow;
+};
+
+/* Load the flows of filename into hugepage memory, the ones without
+ * a frame size get pkt_len */
+bool trace_load(const char *filename, uint16_t pkt_len, struct trace *trace);
+
+#endif /* _PKTGEN_TRACE_H_ */
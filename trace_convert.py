@@ -0,0 +1,85 @@
+import struct
+import sys
+
+# Binary traces, see struct trace_hdr in trace.h: the header, then one
+# record per flow laid out as struct pkt_seq_info (src_ip, dst_ip,
+# proto, pad, src_port, dst_port, pkt_len), then the flow weights
+TRACE_MAGIC = b"PKTTRCB1"
+TRACE_HDR = struct.Struct("<8sIIQ")
+TRACE_REC = struct.Struct("<IIBxHHH")
+TRACE_WEIGHT = struct.Struct("<I")
+# records carry their frame size
+TRACE_F_LEN = 0x1
+# per-flow weights follow the records
+TRACE_F_WEIGHT = 0x2
+TRACE_COL_MIN = 5
+
+def get_binary_filename(textfile):
+    return textfile + ".bin"
+
+# Text traces: src_ip dst_ip src_port dst_port proto, and more
+# columns. A "# <names>" line before the flows may name the "len" and
+# "weight" ones, see trace.h.
+def read_schema(line):
+    names = line[1:].split()
+    len_col = names.index("len") if "len" in names else -1
+    weight_col = names.index("weight") if "weight" in names else -1
+    return (len_col, weight_col)
+
+# Returns the flow records, their weights and the trace flags
+def read_text(infile):
+    (len_col, weight_col) = (-1, -1)
+    recs = []
+    weights = []
+    for line in infile:
+        if line.startswith("#"):
+            if len(recs) == 0:
+                (len_col, weight_col) = read_schema(line)
+            continue
+        cols = line.split()
+        if len(cols) == 0:
+            continue
+        if len(cols) < max(len_col + 1, weight_col + 1, TRACE_COL_MIN):
+            raise ValueError("Wrong trace line: " + line)
+        (src_ip, dst_ip, sport, dport, proto) = [int(c) for c in cols[:5]]
+        pkt_len = int(cols[len_col]) if len_col >= 0 else 0
+        weight = int(cols[weight_col]) if weight_col >= 0 else 1
+        if weight <= 0:
+            raise ValueError("Wrong flow weight: " + line)
+        recs.append(TRACE_REC.pack(src_ip, dst_ip, proto, sport, dport,
+                                   pkt_len))
+        weights.append(weight)
+
+    flags = 0
+    if len_col >= 0:
+        flags |= TRACE_F_LEN
+    if weight_col >= 0:
+        flags |= TRACE_F_WEIGHT
+    return (recs, weights, flags)
+
+def convert(textfile, binfile):
+    infile = open(textfile, mode="r")
+    (recs, weights, flags) = read_text(infile)
+    infile.close()
+
+    outfile = open(binfile, mode="wb")
+    outfile.write(TRACE_HDR.pack(TRACE_MAGIC, TRACE_REC.size, flags,
+                                 len(recs)))
+    for rec in recs:
+        outfile.write(rec)
+    if flags & TRACE_F_WEIGHT:
+        for weight in weights:
+            outfile.write(TRACE_WEIGHT.pack(weight))
+    outfile.close()
+    print("{0} flows written to {1}".format(len(recs), binfile))
+
+if __name__ == "__main__":
+    if (len(sys.argv) != 2 and len(sys.argv) != 3):
+        print("Usage: python ./trace_convert.py <text trace> [<binary trace>]")
+    else:
+        textfile = str(sys.argv[1])
+        if len(sys.argv) == 3:
+            binfile = str(sys.argv[2])
+        else:
+            binfile = get_binary_filename(textfile)
+        convert(textfile, binfile)
@@ -0,0 +1,434 @@
+#include "util.h"
+#include "control.h"
+#include "stat.h"
+#include "rate.h"
+#include "tx.h"
+#include "trial.h"
+#include "pkt_seq.h"
+
+#include <rte_cycles.h>
+#include <rte_atomic.h>
+
+/* - current trial, published to the TX workers */
+static struct trial trial = {
+	.gen = 0,
+	.level = 0,
+	.pkt_len = PKT_SEQ_PKT_LEN,
+	.start_cycle = 0,
+	.stop_cycle = 0,
+};
+
+static struct trial_ctl trial_ctl = {
+	.type = TRIAL_NONE,
+	.loss_tolerance = 0,
+	.trial_sec = TRIAL_SEC_DEF,
+	.nb_size = 0,
+	.nb_step = 0,
+	.sweep_size = PKT_SEQ_PKT_LEN + ETH_CRC_LEN,
+};
+
+/* Format: comma separated frame sizes (FCS included), e.g 64,512,1518 */
+bool trial_set_search(const char *sizes)
+{
+	char *str = NULL, *tok = NULL, *saveptr = NULL;
+	int val = 0;
+	bool ret = true;
+
+	if (trial_ctl.type == TRIAL_SWEEP) {
+		LOG_ERROR("Sweep and throughput search can't be used together");
+		return false;
+	}
+
+	str = strdup(sizes);
+	if (str == NULL)
+		return false;
+
+	trial_ctl.nb_size = 0;
+	for (tok = strtok_r(str, ",", &saveptr); tok != NULL;
+					tok = strtok_r(NULL, ",", &saveptr)) {
+		if (trial_ctl.nb_size == TRIAL_SIZE_MAX) {
+			LOG_ERROR("At most %u frame sizes", TRIAL_SIZE_MAX);
+			ret = false;
+			break;
+		}
+		if (!str_to_int(tok, 10, &val) || val < RTE_ETHER_MIN_LEN
+						|| val > RTE_ETHER_MAX_LEN) {
+			LOG_ERROR("Frame size %s is not in [%u, %u]", tok,
+							RTE_ETHER_MIN_LEN, RTE_ETHER_MAX_LEN);
+			ret = false;
+			break;
+		}
+		trial_ctl.sizes[trial_ctl.nb_size++] = val;
+	}
+	free(str);
+
+	if (ret && trial_ctl.nb_size == 0) {
+		LOG_ERROR("No frame size in %s", sizes);
+		ret = false;
+	}
+	trial_ctl.type = ret ? TRIAL_SEARCH : TRIAL_NONE;
+	return ret;
+}
+
+/* Format: <from>:<to>:<steps>[:<frame size>], rates as for -r and in
+ * the same unit, e.g 10%:100%:10:128. TX runs at up to <to>, see
+ * trial_get_sweep_rate(). */
+bool trial_set_sweep(const char *sweep)
+{
+	char *str = NULL, *tok[4] = {NULL}, *saveptr = NULL;
+	struct rate_ctl from, to;
+	unsigned nb_tok = 0;
+	int val = 0;
+	bool ret = false;
+
+	if (trial_ctl.type == TRIAL_SEARCH) {
+		LOG_ERROR("Sweep and throughput search can't be used together");
+		return false;
+	}
+
+	str = strdup(sweep);
+	if (str == NULL)
+		return false;
+
+	for (nb_tok = 0; nb_tok < 4; nb_tok++) {
+		tok[nb_tok] = strtok_r(nb_tok == 0 ? str : NULL, ":", &saveptr);
+		if (tok[nb_tok] == NULL)
+			break;
+	}
+	if (nb_tok < 3) {
+		LOG_ERROR("Too few parameters in sweep %s", sweep);
+		goto out;
+	}
+
+	if (!rate_set_rate(tok[0], &from) || !rate_set_rate(tok[1], &to))
+		goto out;
+	if (from.unit != to.unit || from.rate > to.rate) {
+		LOG_ERROR("Wrong rates in sweep %s", sweep);
+		goto out;
+	}
+	/* a zero rate isn't paced, and the first step is the baseline of
+	 * the knee detection */
+	if (from.rate <= 0) {
+		LOG_ERROR("Sweep should start above 0, %s", sweep);
+		goto out;
+	}
+
+	if (!str_to_int(tok[2], 10, &val) || val < 2 || val > TRIAL_STEP_MAX) {
+		LOG_ERROR("Number of sweep steps %s is not in [2, %u]", tok[2],
+						TRIAL_STEP_MAX);
+		goto out;
+	}
+	trial_ctl.nb_step = val;
+
+	if (nb_tok == 4) {
+		if (!str_to_int(tok[3], 10, &val)
+						|| val < PKT_SEQ_LATENCY_MINSIZE + ETH_CRC_LEN
+						|| val > RTE_ETHER_MAX_LEN) {
+			LOG_ERROR("Frame size %s is not in [%u, %u]", tok[3],
+							PKT_SEQ_LATENCY_MINSIZE + ETH_CRC_LEN,
+							RTE_ETHER_MAX_LEN);
+			goto out;
+		}
+		trial_ctl.sweep_size = val;
+	}
+
+	trial_ctl.sweep_unit = from.unit;
+	trial_ctl.sweep_from = from.rate;
+	trial_ctl.sweep_to = to.rate;
+	ret = true;
+
+out:
+	free(str);
+	trial_ctl.type = ret ? TRIAL_SWEEP : TRIAL_NONE;
+	return ret;
+}
+
+/* Loss tolerance in percent of the sent packets */
+bool trial_set_loss_tolerance(const char *loss)
+{
+	double val = 0;
+
+	if (!str_to_double(loss, &val) || val < 0 || val > 100) {
+		LOG_ERROR("Wrong loss tolerance %s", loss);
+		return false;
+	}
+	trial_ctl.loss_tolerance = val / 100;
+	return true;
+}
+
+/* The TX rate of a sweep is its upper bound, false if no sweep */
+bool trial_get_sweep_rate(struct rate_ctl *rate)
+{
+	if (trial_ctl.type != TRIAL_SWEEP)
+		return false;
+
+	memset(rate, 0, sizeof(struct rate_ctl));
+	rate->unit = trial_ctl.sweep_unit;
+	rate->rate = trial_ctl.sweep_to;
+	return true;
+}
+
+bool trial_is_enabled(void)
+{
+	return trial_ctl.type != TRIAL_NONE;
+}
+
+const struct trial *trial_get(void)
+{
+	return &trial;
+}
+
+static inline bool __trial_is_aborted(void)
+{
+	return ctl_is_stop(WORKER_TX) || ctl_get_state(WORKER_TX) != STATE_INITED;
+}
+
+/* Run one trial and count the packets it lost. TX is idle between
+ * trials, so the counters don't move outside of them. The latencies of
+ * the trial are summarized in lat, if not NULL. */
+static bool __run_trial(double level, uint16_t pkt_len,
+				struct trial_result *res, struct stat_lat_summary *lat)
+{
+	uint64_t hz = rte_get_tsc_hz();
+	uint64_t tx_bytes = 0, tx_pkts = 0, rx_bytes = 0, rx_pkts = 0;
+	uint64_t until = 0;
+	bool is_lat = false;
+
+	stat_get_total(STAT_IDX_TX, &tx_bytes, &tx_pkts);
+	stat_get_total(STAT_IDX_RX, &rx_bytes, &rx_pkts);
+
+	trial.level = level;
+	trial.pkt_len = pkt_len;
+	trial.start_cycle = rte_get_tsc_cycles() + TRIAL_START_MS * hz / 1000;
+	trial.stop_cycle = trial.start_cycle + trial_ctl.trial_sec * hz;
+	/* TX tags the packets of the trial with its gen */
+	if (lat != NULL)
+		is_lat = stat_lat_window_begin((trial.gen + 1) & RATE_PROFILE_STEP_MAX,
+						trial.start_cycle, trial.stop_cycle);
+	rte_smp_wmb();
+	trial.gen++;
+
+	until = trial.stop_cycle + TRIAL_DRAIN_MS * hz / 1000;
+	while (rte_get_tsc_cycles() < until) {
+		if (__trial_is_aborted()) {
+			if (is_lat)
+				stat_lat_window_end(lat);
+			return false;
+		}
+		stat_poll(until);
+	}
+	if (is_lat)
+		stat_lat_window_end(lat);
+
+	memset(res, 0, sizeof(struct trial_result));
+	res->level = level;
+	stat_get_total(STAT_IDX_TX, &res->tx_bytes, &res->tx_pkts);
+	stat_get_total(STAT_IDX_RX, &rx_bytes, &res->rx_pkts);
+	res->tx_bytes -= tx_bytes;
+	res->tx_pkts -= tx_pkts;
+	res->rx_pkts -= rx_pkts;
+	if (res->tx_pkts > 0)
+		res->loss = ((double)res->tx_pkts - (double)res->rx_pkts)
+						/ res->tx_pkts;
+
+	LOG_INFO("Trial %u: %u bytes at %.3f %s, TX %lu, RX %lu, loss %.4f%%",
+					trial.gen, pkt_len + ETH_CRC_LEN, level,
+					rate_unit_name(tx_get_rate()->unit),
+					res->tx_pkts, res->rx_pkts, res->loss * 100);
+	if (is_lat && lat->is_valid)
+		LOG_INFO("Trial %u: latency p50 %.3f us (%.3f -> %.3f), "
+						"p99 %.3f us, max %.3f us", trial.gen, lat->p50,
+						lat->p50_first, lat->p50_last, lat->p99, lat->max);
+	return true;
+}
+
+/* Binary search of the highest rate up to the TX rate whose loss is
+ * within the tolerance (RFC 2544, section 26.1) */
+static bool __search_size(unsigned idx)
+{
+	struct trial_result res, *best = &trial_ctl.result[idx];
+	uint16_t pkt_len = trial_ctl.sizes[idx] - ETH_CRC_LEN;
+	double max = tx_get_rate()->rate;
+	double lo = 0, hi = max, level = max;
+
+	memset(best, 0, sizeof(struct trial_result));
+	while (true) {
+		if (!__run_trial(level, pkt_len, &res, NULL))
+			return false;
+
+		if (res.tx_pkts > 0 && res.loss <= trial_ctl.loss_tolerance) {
+			*best = res;
+			lo = level;
+		} else
+			hi = level;
+
+		if (hi - lo <= max * TRIAL_SEARCH_RES)
+			break;
+		level = (lo + hi) / 2;
+	}
+	return true;
+}
+
+static void __print_search(unsigned nb_size)
+{
+	struct trial_result *res = NULL;
+	double sec = trial_ctl.trial_sec;
+	unsigned i = 0;
+
+	LOG_INFO("RFC 2544 throughput, loss tolerance %.4f%%",
+					trial_ctl.loss_tolerance * 100);
+	LOG_INFO("%8s %20s %14s %12s %10s", "frame", "rate", "L1 mbps",
+					"mpps", "loss %");
+	for (i = 0; i < nb_size; i++) {
+		res = &trial_ctl.result[i];
+		if (res->tx_pkts == 0) {
+			LOG_INFO("%8u %20s", trial_ctl.sizes[i], "no rate passed");
+			continue;
+		}
+		LOG_INFO("%8u %14.3f %5s %14.3f %12.6f %10.4f", trial_ctl.sizes[i],
+					res->level, rate_unit_name(tx_get_rate()->unit),
+					(res->tx_bytes + res->tx_pkts * (PKT_SEQ_WIRE_OVERHEAD))
+							* 8 / sec / 1e6,
+					res->tx_pkts / sec / 1e6, res->loss * 100);
+	}
+}
+
+/* Whether sweep step idx is past the knee of the latency curve */
+static bool __is_knee(unsigned idx)
+{
+	struct trial_result *res = &trial_ctl.step_result[idx];
+	struct stat_lat_summary *lat = &trial_ctl.step_lat[idx];
+	struct stat_lat_summary *base = &trial_ctl.step_lat[0];
+
+	if (res->tx_pkts == 0 || res->loss > trial_ctl.loss_tolerance) {
+		LOG_INFO("Step %u: loss %.4f%% beyond the tolerance", idx,
+						res->loss * 100);
+		return true;
+	}
+	/* the sweep stops there, see __run_sweep() */
+	if (!lat->is_valid)
+		return false;
+	if (lat->p50_last > lat->p50_first * TRIAL_KNEE_GROWTH
+					&& lat->p50_last - lat->p50_first > TRIAL_KNEE_GROWTH_US) {
+		LOG_INFO("Step %u: median grows from %.3f us to %.3f us", idx,
+						lat->p50_first, lat->p50_last);
+		return true;
+	}
+	if (idx > 0 && lat->p99 > base->p99 * TRIAL_KNEE_P99) {
+		LOG_INFO("Step %u: p99 %.3f us, %.1f times the first step", idx,
+						lat->p99, lat->p99 / base->p99);
+		return true;
+	}
+	return false;
+}
+
+/* Run the steps of the sweep from the lowest load up to the knee,
+ * returns the number of steps run and the knee in knee (nb_step if no
+ * knee was found) */
+static unsigned __run_sweep(unsigned *knee)
+{
+	uint16_t pkt_len = trial_ctl.sweep_size - ETH_CRC_LEN;
+	double level = 0;
+	unsigned i = 0;
+
+	*knee = trial_ctl.nb_step;
+	for (i = 0; i < trial_ctl.nb_step; i++) {
+		level = trial_ctl.sweep_from + (trial_ctl.sweep_to
+						- trial_ctl.sweep_from) * i / (trial_ctl.nb_step - 1);
+		if (!__run_trial(level, pkt_len, &trial_ctl.step_result[i],
+								&trial_ctl.step_lat[i])) {
+			LOG_INFO("Sweep aborted");
+			break;
+		}
+		if (__is_knee(i)) {
+			*knee = i;
+			i++;
+			break;
+		}
+		if (!trial_ctl.step_lat[i].is_valid) {
+			LOG_INFO("Step %u: no valid latency sample, sweep stopped", i);
+			i++;
+			break;
+		}
+	}
+	return i;
+}
+
+static void __print_sweep(unsigned nb_run, unsigned knee)
+{
+	struct trial_result *res = NULL;
+	struct stat_lat_summary *lat = NULL;
+	const char *unit = rate_unit_name(tx_get_rate()->unit);
+	double sec = trial_ctl.trial_sec;
+	unsigned i = 0;
+
+	LOG_INFO("Latency vs load, %u bytes, loss tolerance %.4f%%",
+					trial_ctl.sweep_size, trial_ctl.loss_tolerance * 100);
+	LOG_INFO("%4s %20s %10s %10s %10s %10s %10s %10s %10s", "step", "rate",
+					"mpps", "loss %", "p50 us", "p99 us", "p99.9 us",
+					"max us", "p50 drift");
+	for (i = 0; i < nb_run; i++) {
+		res = &trial_ctl.step_result[i];
+		lat = &trial_ctl.step_lat[i];
+		if (!lat->is_valid) {
+			LOG_INFO("%4u %14.3f %5s %10.6f %10.4f %10s%s", i, res->level,
+							unit, res->tx_pkts / sec / 1e6, res->loss * 100,
+							"invalid", i == knee ? " <- knee" : "");
+			continue;
+		}
+		LOG_INFO("%4u %14.3f %5s %10.6f %10.4f %10.3f %10.3f %10.3f %10.3f "
+						"%10.3f%s", i, res->level, unit,
+						res->tx_pkts / sec / 1e6, res->loss * 100,
+						lat->p50, lat->p99, lat->p999, lat->max,
+						lat->p50_last - lat->p50_first,
+						i == knee ? " <- knee" : "");
+	}
+
+	if (knee == 0) {
+		LOG_INFO("Knee at the first step, no usable capacity");
+	} else if (nb_run < trial_ctl.nb_step && knee == trial_ctl.nb_step) {
+		LOG_INFO("Sweep stopped before the knee");
+	} else if (knee == trial_ctl.nb_step) {
+		LOG_INFO("No knee up to %.3f %s", trial_ctl.sweep_to, unit);
+	} else {
+		LOG_INFO("Knee at %.3f %s, usable capacity %.3f %s",
+						trial_ctl.step_result[knee].level, unit,
+						trial_ctl.step_result[knee - 1].level, unit);
+	}
+}
+
+/* Runs on the stat thread, once all TX and RX queues are up */
+void trial_thread_run(void)
+{
+	unsigned i = 0, knee = 0;
+
+	while (ctl_get_state(WORKER_TX) == STATE_UNINIT
+					|| ctl_get_state(WORKER_RX) == STATE_UNINIT) {
+		if (ctl_is_stop(WORKER_TX))
+			return;
+		stat_poll(rte_get_tsc_cycles() + rte_get_tsc_hz() / 1000);
+	}
+
+	if (__trial_is_aborted()) {
+		LOG_ERROR("TX is not running, no trial");
+		return;
+	}
+
+	if (trial_ctl.type == TRIAL_SWEEP) {
+		if (tx_get_rate()->unit != trial_ctl.sweep_unit) {
+			LOG_ERROR("Sweep and TX rate are in different units");
+			return;
+		}
+		i = __run_sweep(&knee);
+		__print_sweep(i, knee);
+		return;
+	}
+
+	for (i = 0; i < trial_ctl.nb_size; i++) {
+		if (!__search_size(i)) {
+			LOG_INFO("Search aborted");
+			break;
+		}
+	}
+	__print_search(i);
+}
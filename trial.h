@@ -0,0 +1,95 @@
+#ifndef _PKTGEN_TRIAL_H_
+#define _PKTGEN_TRIAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <rte_common.h>
+
+#include "stat.h"
+#include "rate.h"
+
+/* Trial timing: TX starts TRIAL_START_MS after a trial is published,
+ * sends for trial_sec seconds, then RX gets TRIAL_DRAIN_MS to receive
+ * what is still in flight */
+#define TRIAL_SEC_DEF 2
+#define TRIAL_START_MS 10
+#define TRIAL_DRAIN_MS 500
+
+/* The search stops when the rate is known within this fraction of
+ * the max rate */
+#define TRIAL_SEARCH_RES 0.001
+
+#define TRIAL_SIZE_MAX 16
+
+/* A sweep step is the knee when its loss exceeds the tolerance, when
+ * its p99 exceeds TRIAL_KNEE_P99 times the p99 of the first step, or
+ * when its median grows by TRIAL_KNEE_GROWTH times (and at least
+ * TRIAL_KNEE_GROWTH_US) from the first to the second half of the
+ * trial, i.e. a queue builds up. */
+#define TRIAL_STEP_MAX 64
+#define TRIAL_KNEE_P99 2.0
+#define TRIAL_KNEE_GROWTH 1.5
+#define TRIAL_KNEE_GROWTH_US 1.0
+
+enum {
+	TRIAL_NONE = 0,
+	TRIAL_SEARCH,
+	TRIAL_SWEEP,
+};
+
+/* Published by the stat thread, read by the TX workers. A new gen
+ * means a new trial: send pkt_len-byte packets at level (in the unit
+ * of the TX rate) from start_cycle to stop_cycle. */
+struct trial {
+	volatile uint32_t gen;
+	double level;
+	uint16_t pkt_len;
+	uint64_t start_cycle;
+	uint64_t stop_cycle;
+} __rte_cache_aligned;
+
+struct trial_result {
+	double level;
+	uint64_t tx_pkts;
+	uint64_t tx_bytes;
+	uint64_t rx_pkts;
+	double loss;
+};
+
+/* Owned by the stat thread */
+struct trial_ctl {
+	unsigned type;
+	double loss_tolerance;
+	unsigned trial_sec;
+
+	/* frame sizes, FCS included */
+	unsigned nb_size;
+	uint16_t sizes[TRIAL_SIZE_MAX];
+	struct trial_result result[TRIAL_SIZE_MAX];
+
+	/* sweep of nb_step levels from sweep_from to sweep_to */
+	unsigned sweep_unit;
+	double sweep_from;
+	double sweep_to;
+	unsigned nb_step;
+	uint16_t sweep_size;
+	struct trial_result step_result[TRIAL_STEP_MAX];
+	struct stat_lat_summary step_lat[TRIAL_STEP_MAX];
+};
+
+bool trial_set_search(const char *sizes);
+
+bool trial_set_sweep(const char *sweep);
+
+bool trial_set_loss_tolerance(const char *loss);
+
+bool trial_get_sweep_rate(struct rate_ctl *rate);
+
+bool trial_is_enabled(void);
+
+const struct trial *trial_get(void);
+
+void trial_thread_run(void);
+
+#endif /* _PKTGEN_TRIAL_H_ */
@@ -7,6 +7,8 @@
 #include <rte_ethdev.h>
 #include <rte_hash_crc.h>
 #include <rte_random.h>
+#include <rte_atomic.h>
+#include <rte_malloc.h>
 
 #include "util.h"
 #include "control.h"
@@ -14,22 +16,34 @@
 #include "stat.h"
 #include "pkt_seq.h"
 #include "rate.h"
+#include "trial.h"
+#include "pcap_file.h"
+#include "trace.h"
 
 /**** TX ****/
-/* - default tx rate: 1mbps */
+/* - default tx rate: 1mbps on the wire */
 #define TX_RATE_DEF "1M"
+#define TX_RATE_TRIAL_DEF "100%"
 
 struct pkt_setup_param {
 	struct pkt_seq_info *info;
 	unsigned int type;
 };
 
-static struct tx_ctl tx_ctl = {
+/* - configuration shared by all TX workers */
+static struct tx_ctl tx_conf = {
 	.tx_type = TX_TYPE_SINGLE,
+	.queue = 0,
 	.tx_mp = NULL,
+	.is_prebuilt = false,
+	.is_split = false,
+	.hdr_mp = NULL,
+	.ind_mp = NULL,
+	.payload_mp = NULL,
+	.payload = NULL,
 	.tx_rate = {
-		.rate_bps = 0,
-		.cycle_per_pkt = 0,
+		.unit = RATE_UNIT_BPS,
+		.rate = 0,
 		.next_tx_cycle = 0,
 	},
 	.tx_count = 0,
@@ -37,25 +51,54 @@ static struct tx_ctl tx_ctl = {
 	.tx_burst = TX_BURST,
     .nb_trace = 0,
     .trace_iter = 0,
-	.trace = {
-		{
-			.src_ip = 0,
-			.dst_ip = 0, 
-			.src_port = 0,
-			.dst_port = 0,
-			.proto = 0,
-			.pkt_len = 0,
-		}
-	},
+	.trace = NULL,
+	.trace_img = NULL,
+	.trace_weight = NULL,
+	.trace_sched = NULL,
+	.nb_sched = 0,
+	.max_pkt_len = 0,
+	.pcap_file = {'\0'},
+	.pcap = NULL,
+	.nb_pcap = 0,
+	.pcap_first = 0,
+	.pcap_step = 1,
+	.pcap_iter = 0,
+	.pcap_loops = 1,
+	.pcap_loop = 0,
+	.pcap_speed = 0,
+	.pcap_loop_len = 0,
+	.pcap_loop_cycle = 0,
 	.is_latency = false,
+	.is_late_ts = false,
+	.sample_type = TX_SAMPLE_ALL,
+	.sample_every = 0,
+	.sample_next = 0,
+	.is_trial = false,
+	.trial_gen = 0,
+	.trial_stop_cycle = 0,
+	.lat_id = 0,
 	.len = 0,
 	.offset = 0,
 	.mbuf_tbl = {NULL},
 };
 
-void tx_set_rate(const char *rate_str)
+/* - per-queue TX workers */
+static struct tx_ctl tx_ctls[WORKER_QUEUE_MAX];
+/* first flow of the trace slice of each TX queue */
+static unsigned tx_trace_first[WORKER_QUEUE_MAX + 1];
+static unsigned tx_nb_queue = 0;
+static rte_atomic32_t tx_running = RTE_ATOMIC32_INIT(0);
+/* start of the pcap replay, common to all queues */
+static rte_atomic64_t tx_pcap_start = RTE_ATOMIC64_INIT(0);
+
+const struct rate_ctl *tx_get_rate(void)
 {
-	rate_set_rate(rate_str, &tx_ctl.tx_rate);
+	return &tx_conf.tx_rate;
+}
+
+bool tx_set_rate(const char *rate_str)
+{
+	return rate_set_rate(rate_str, &tx_conf.tx_rate);
 }
 
 void tx_set_count(int cnt)
@@ -64,13 +107,91 @@ void tx_set_count(int cnt)
 		LOG_INFO("TX count value %d is invalid", cnt);
 		return;
 	}
-	tx_ctl.tx_count = cnt;
-	tx_ctl.tx_ret = cnt;
+	tx_conf.tx_count = cnt;
+	tx_conf.tx_ret = cnt;
 }
 
 void tx_enable_latency(void)
 {
-	tx_ctl.is_latency = true;
+	tx_conf.is_latency = true;
+}
+
+void tx_enable_late_timestamp(void)
+{
+	tx_conf.is_late_ts = true;
+}
+
+/* Format: <n> for one packet in n, or <t>us for one packet every t
+ * usec on each TX queue */
+bool tx_set_sampling(const char *sample)
+{
+	char *unit = NULL;
+	unsigned long val = 0;
+
+	errno = 0;
+	val = strtoul(sample, &unit, 10);
+	if (errno != 0 || unit == sample || val == 0) {
+		LOG_ERROR("Wrong latency sampling %s", sample);
+		return false;
+	}
+
+	if (*unit == '\0') {
+		tx_conf.sample_type = (val == 1) ? TX_SAMPLE_ALL : TX_SAMPLE_COUNT;
+	} else if (strcmp(unit, "us") == 0) {
+		tx_conf.sample_type = TX_SAMPLE_TIME;
+	} else {
+		LOG_ERROR("Wrong latency sampling unit in %s", sample);
+		return false;
+	}
+	tx_conf.sample_every = val;
+	return true;
+}
+
+void tx_enable_prebuilt(void)
+{
+	tx_conf.is_prebuilt = true;
+}
+
+void tx_enable_split(void)
+{
+	tx_conf.is_split = true;
+}
+
+/* Format: <pcap file>[:<loops>[:<speed>]], loops 0 to replay until
+ * stopped. With a speed, packets are sent at their capture times scaled
+ * by it (2 for twice as fast), else at the TX rate. */
+bool tx_set_pcap(const char *spec)
+{
+	char buf[FILEPATH_MAX];
+	char *loops = NULL, *speed = NULL;
+	int val = 0;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	loops = strchr(buf, ':');
+	if (loops) {
+		*loops++ = '\0';
+		speed = strchr(loops, ':');
+		if (speed)
+			*speed++ = '\0';
+		if (!str_to_int(loops, 10, &val) || val < 0) {
+			LOG_ERROR("Wrong number of pcap loops %s", loops);
+			return false;
+		}
+		tx_conf.pcap_loops = val;
+	}
+
+	if (speed && (!str_to_double(speed, &tx_conf.pcap_speed)
+					|| tx_conf.pcap_speed <= 0)) {
+		LOG_ERROR("Wrong pcap replay speed %s", speed);
+		return false;
+	}
+
+	if (access(buf, F_OK) == -1) {
+		LOG_ERROR("Pcap file %s doesn't exist", buf);
+		return false;
+	}
+	snprintf(tx_conf.pcap_file, FILEPATH_MAX, "%s", buf);
+	return true;
 }
 
 void tx_set_burst(int burst)
@@ -80,7 +201,7 @@ void tx_set_burst(int burst)
 						burst, TX_BURST);
 		return;
 	}
-	tx_ctl.tx_burst = burst;
+	tx_conf.tx_burst = burst;
 }
 
 static void __set_tx_pkt_info(struct pkt_seq_info *info)
@@ -89,123 +210,777 @@ static void __set_tx_pkt_info(struct pkt_seq_info *info)
 	pkt_seq_set_dst_mac(1);
 
 	if (info == NULL) {
-		pkt_seq_init(&tx_ctl.pkt_info);
+		pkt_seq_init(&tx_conf.pkt_info);
 	} else {
-		tx_ctl.pkt_info.src_ip = info->src_ip;
-		tx_ctl.pkt_info.dst_ip = info->dst_ip;
-		tx_ctl.pkt_info.proto = info->proto;
-		tx_ctl.pkt_info.src_port = info->src_port;
-		tx_ctl.pkt_info.dst_port = info->dst_port;
-		tx_ctl.pkt_info.pkt_len = info->pkt_len;
+		tx_conf.pkt_info.src_ip = info->src_ip;
+		tx_conf.pkt_info.dst_ip = info->dst_ip;
+		tx_conf.pkt_info.proto = info->proto;
+		tx_conf.pkt_info.src_port = info->src_port;
+		tx_conf.pkt_info.dst_port = info->dst_port;
+		tx_conf.pkt_info.pkt_len = info->pkt_len;
 	}
 }
 
-static inline void __pkt_setup(struct rte_mbuf *m, unsigned tx_type)
+/* Next flow of the trace, in the weighted order if any */
+static inline unsigned __next_flow(struct tx_ctl *ctl)
+{
+	unsigned flow = ctl->trace_iter;
+
+	if (ctl->trace_sched) {
+		flow = ctl->trace_sched[ctl->trace_iter];
+		if (++ctl->trace_iter == ctl->nb_sched)
+			ctl->trace_iter = 0;
+		return flow;
+	}
+
+	if (++ctl->trace_iter == ctl->nb_trace)
+		ctl->trace_iter = 0;
+	return flow;
+}
+
+static inline struct pkt_seq_info *__next_pkt_info(struct tx_ctl *ctl)
 {
     struct pkt_seq_info *info = NULL;
     uint64_t val = 0;
 
-    switch (tx_type) {
+    switch (ctl->tx_type) {
         case TX_TYPE_RANDOM:
-            info = &(tx_ctl.pkt_info);
+            info = &(ctl->pkt_info);
             val = rte_rand();
             info->src_ip = val & 0xffffffff;
 		    info->dst_ip = (val >> 32) &0xffffffff;
             break;
         case TX_TYPE_5TUPLE_TRACE:
-            info = &(tx_ctl.trace[tx_ctl.trace_iter]);
-            tx_ctl.trace_iter ++;
-            if (tx_ctl.trace_iter == tx_ctl.nb_trace)
-                tx_ctl.trace_iter = 0;
+            info = &(ctl->trace[__next_flow(ctl)]);
             break;
         case TX_TYPE_SINGLE:
         default:
-            info = &(tx_ctl.pkt_info);
+            info = &(ctl->pkt_info);
             break;
     }
+    return info;
+}
+
+/* Whether the next packet, sent at cycle, is a latency sample */
+static inline bool __lat_sample(struct tx_ctl *ctl, uint64_t cycle)
+{
+	if (!ctl->is_latency)
+		return false;
 
-	pkt_seq_fill_mbuf(m, info, tx_ctl.is_latency);
+	switch (ctl->sample_type) {
+		case TX_SAMPLE_COUNT:
+			if (--ctl->sample_next > 0)
+				return false;
+			ctl->sample_next = ctl->sample_every;
+			return true;
+		case TX_SAMPLE_TIME:
+			if (cycle < ctl->sample_next)
+				return false;
+			ctl->sample_next = cycle + ctl->sample_every;
+			return true;
+		default:
+			return true;
+	}
 }
 
-static bool __load_tuple_traces(const char *filename)
+static inline bool __pkt_setup(struct tx_ctl *ctl, struct rte_mbuf *m,
+				uint64_t cycle)
 {
-    FILE *fp = fopen(filename, "r");
-    struct pkt_seq_info *tuples = tx_ctl.trace;
-    unsigned cnt = 0;
-    unsigned sport, dport, proto, tmp0, tmp1;
+	bool is_lat = __lat_sample(ctl, cycle);
 
-    if (!fp) {
-        LOG_ERROR("Failed to open trace file %s", filename);
-        return false;
-    }
+	pkt_seq_fill_mbuf(m, __next_pkt_info(ctl), is_lat, ctl->lat_id);
+	if (is_lat)
+		ctl->lat_id ++;
+	return is_lat;
+}
 
-    while (!feof(fp)) {
-        int ret = 0;
+/* Allocate and chain the header, payload and tail segments of cnt
+ * split packets into ctl->mbuf_tbl */
+static int __pkt_setup_split(struct tx_ctl *ctl, unsigned cnt,
+				uint64_t cycle)
+{
+	struct rte_mbuf *ind[TX_BURST], *tail[TX_BURST];
+	unsigned i = 0;
 
-        ret = fscanf(fp, "%u %u %u %u %u %u %u\n",
-                        &(tuples->src_ip), &(tuples->dst_ip),
-                        &sport, &dport, &proto, &tmp0, &tmp1);
-        if (ret != 7) {
-            LOG_ERROR("Failed to read tuples[%u]", cnt);
-            break;
-        }
-		tuples->src_port = sport;
-		tuples->dst_port = dport;
-		tuples->proto = proto;
-        tuples->pkt_len = tx_ctl.pkt_info.pkt_len;
-        cnt++;
-        tuples++;
-        if (cnt == TUPLE_TRACE_MAX) {
-            LOG_INFO("Only support up to %u traces", TUPLE_TRACE_MAX);
-            break;
-        }
-    }
+	if (rte_pktmbuf_alloc_bulk(ctl->hdr_mp, ctl->mbuf_tbl, cnt) != 0)
+		return -ENOMEM;
+	if (rte_pktmbuf_alloc_bulk(ctl->hdr_mp, tail, cnt) != 0)
+		goto free_hdr;
+	if (rte_pktmbuf_alloc_bulk(ctl->ind_mp, ind, cnt) != 0)
+		goto free_tail;
 
-    if (cnt > 0) {
-        LOG_INFO("Load %u traces", cnt);
-        tx_ctl.nb_trace = cnt;
-        fclose(fp);
-        return true;
-    }
+	for (i = 0; i < cnt; i++) {
+		ctl->is_sampled[i] = __lat_sample(ctl, cycle);
+		pkt_seq_fill_split(ctl->mbuf_tbl[i], ind[i], tail[i], ctl->payload,
+					__next_pkt_info(ctl), ctl->is_sampled[i], ctl->lat_id);
+		ctl->tx_len[i] = ctl->mbuf_tbl[i]->pkt_len;
+		if (ctl->is_sampled[i])
+			ctl->lat_id ++;
+	}
+	return 0;
+
+free_tail:
+	rte_mempool_put_bulk(ctl->hdr_mp, (void **)tail, cnt);
+free_hdr:
+	rte_mempool_put_bulk(ctl->hdr_mp, (void **)ctl->mbuf_tbl, cnt);
+	return -ENOMEM;
+}
+
+/* Whether the queue replayed all its loops of the capture */
+static inline bool __pcap_is_done(const struct tx_ctl *ctl)
+{
+	return ctl->pcap_first >= ctl->nb_pcap
+			|| (ctl->pcap_loops && ctl->pcap_loop == ctl->pcap_loops);
+}
+
+/* Stamped copy of a captured packet, the original may still be in
+ * the TX ring */
+static struct rte_mbuf *__pcap_lat_copy(struct tx_ctl *ctl,
+				struct rte_mbuf *orig)
+{
+	struct rte_mbuf *m = rte_pktmbuf_alloc(ctl->tx_mp);
+
+	if (!m)
+		return NULL;
+	rte_memcpy(rte_pktmbuf_append(m, orig->pkt_len),
+					rte_pktmbuf_mtod(orig, void *), orig->pkt_len);
+	pkt_seq_raw_update_latency(m, ctl->lat_id);
+	ctl->lat_id ++;
+	return m;
+}
+
+/* Take up to cnt next packets of the capture into ctl->mbuf_tbl, only
+ * the ones due at cycle when replaying at the capture timing. Latency
+ * samples are taken among the packets the fields fit in. Returns the
+ * number of packets taken. */
+static unsigned __pkt_setup_pcap(struct tx_ctl *ctl, unsigned cnt,
+				uint64_t cycle)
+{
+	struct tx_pcap_pkt *pkt = NULL;
+	struct rte_mbuf *m = NULL;
+	unsigned nb = 0;
+
+	/* the first queue to send starts the replay of all of them, so
+	 * that their packets keep the capture timing between each other */
+	if (ctl->pcap_loop_cycle == 0) {
+		rte_atomic64_cmpset((volatile uint64_t *)&tx_pcap_start.cnt,
+						0, cycle);
+		ctl->pcap_loop_cycle = rte_atomic64_read(&tx_pcap_start);
+	}
+
+	while (nb < cnt && !__pcap_is_done(ctl)) {
+		pkt = &ctl->pcap[ctl->pcap_iter];
+		if (ctl->pcap_speed > 0 && cycle < ctl->pcap_loop_cycle + pkt->cycle)
+			break;
+
+		m = NULL;
+		if (pkt->is_lat_ok && __lat_sample(ctl, cycle))
+			m = __pcap_lat_copy(ctl, pkt->m);
+		ctl->is_sampled[nb] = (m != NULL);
+		if (!m) {
+			/* given back by the PMD once sent */
+			m = pkt->m;
+			rte_mbuf_refcnt_update(m, 1);
+		}
+		ctl->tx_len[nb] = m->pkt_len;
+		ctl->mbuf_tbl[nb++] = m;
+
+		ctl->pcap_iter += ctl->pcap_step;
+		if (ctl->pcap_iter >= ctl->nb_pcap) {
+			ctl->pcap_iter = ctl->pcap_first;
+			ctl->pcap_loop++;
+			ctl->pcap_loop_cycle += ctl->pcap_loop_len;
+		}
+	}
+	return nb;
+}
+
+/* Images are zeroed at allocation, a built one has an EtherType */
+static inline bool __trace_img_is_built(const struct pkt_seq_hdr_img *img)
+{
+	return ((const struct rte_ether_hdr *)img->data)->ether_type != 0;
+}
+
+/* Packets of the prebuilt pool only need their varying fields rewritten,
+ * the latency marker is toggled for the samples */
+static inline bool __pkt_update(struct tx_ctl *ctl, struct rte_mbuf *m,
+				uint64_t cycle)
+{
+	struct pkt_seq_hdr_img *img = NULL;
+	uint64_t val = 0;
+	unsigned flow = 0;
+	bool is_lat = false;
+
+	if (ctl->tx_type == TX_TYPE_RANDOM) {
+		val = rte_rand();
+		pkt_seq_update_addr(m, val & 0xffffffff, (val >> 32) & 0xffffffff);
+	} else if (ctl->tx_type == TX_TYPE_5TUPLE_TRACE) {
+		flow = __next_flow(ctl);
+		/* image checksums are computed with a zeroed payload, the
+		 * latency fields of the previous use of the packet are
+		 * cleared before it takes the frame size of the flow */
+		if (ctl->is_latency)
+			memset(rte_pktmbuf_mtod_offset(m, void *,
+						m->pkt_len - sizeof(struct pkt_latency)),
+					0, sizeof(struct pkt_latency));
+		img = &ctl->trace_img[flow];
+		if (unlikely(!__trace_img_is_built(img)))
+			pkt_seq_build_hdr_img(&ctl->trace[flow], img, ctl->is_latency);
+		rte_memcpy(rte_pktmbuf_mtod(m, void *), img,
+					sizeof(struct pkt_seq_hdr_img));
+		m->pkt_len = ctl->trace[flow].pkt_len;
+		m->data_len = ctl->trace[flow].pkt_len;
+		/* flows of a trace mix TCP and UDP */
+		pkt_seq_set_tx_offload(m, ctl->trace[flow].proto);
+	}
+
+	if (ctl->is_latency) {
+		is_lat = __lat_sample(ctl, cycle);
+		pkt_seq_set_latency_mark(m, is_lat);
+		if (is_lat) {
+			pkt_seq_update_latency(m, ctl->lat_id);
+			ctl->lat_id ++;
+		}
+	}
+	return is_lat;
+}
+
+static void __pkt_prebuild(struct rte_mempool *mp __rte_unused,
+				void *opaque, void *obj, unsigned obj_idx __rte_unused)
+{
+	struct tx_ctl *ctl = (struct tx_ctl *)opaque;
+	struct rte_mbuf *m = (struct rte_mbuf *)obj;
+
+	/* zero payload, so that the TCP checksum only depends on headers
+	 * and latency fields */
+	memset(rte_pktmbuf_mtod(m, void *), 0, ctl->max_pkt_len);
+	pkt_seq_fill_mbuf(m, &ctl->pkt_info, ctl->is_latency, ctl->lat_id);
+}
+
+static bool __tx_prebuild_pool(struct tx_ctl *ctl)
+{
+	char name[RTE_MEMPOOL_NAMESIZE];
+	struct rte_mempool *mp = NULL;
+
+	snprintf(name, sizeof(name), "TX_POOL_%u", ctl->queue);
+	mp = rte_pktmbuf_pool_create(name, TX_POOL_SIZE, TX_POOL_CACHE_SIZE,
+					0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+	if (mp == NULL) {
+		LOG_ERROR("Failed to create TX pool for queue %u", ctl->queue);
+		return false;
+	}
+
+	rte_mempool_obj_iter(mp, __pkt_prebuild, ctl);
+	ctl->tx_mp = mp;
+	LOG_INFO("Prebuilt %u packets for TX queue %u", TX_POOL_SIZE, ctl->queue);
+	return true;
+}
+
+/* Small pools for the header/tail segments and the indirect mbufs, and
+ * one zeroed payload buffer shared by all packets of the queue */
+static bool __tx_split_pools(struct tx_ctl *ctl)
+{
+	char name[RTE_MEMPOOL_NAMESIZE];
+	unsigned len = ctl->max_pkt_len;
+
+	if (ctl->pkt_info.pkt_len < pkt_seq_hdr_len(&ctl->pkt_info)
+					+ sizeof(struct pkt_latency)) {
+		LOG_ERROR("Packet length %u is too small to be split",
+						ctl->pkt_info.pkt_len);
+		return false;
+	}
+
+	snprintf(name, sizeof(name), "TX_HDR_POOL_%u", ctl->queue);
+	ctl->hdr_mp = rte_pktmbuf_pool_create(name, TX_HDR_POOL_SIZE,
+					TX_POOL_CACHE_SIZE, 0, TX_HDR_DATA_ROOM, rte_socket_id());
+	if (ctl->hdr_mp == NULL) {
+		LOG_ERROR("Failed to create TX header pool for queue %u", ctl->queue);
+		goto free_pools;
+	}
+
+	snprintf(name, sizeof(name), "TX_IND_POOL_%u", ctl->queue);
+	ctl->ind_mp = rte_pktmbuf_pool_create(name, TX_POOL_SIZE,
+					TX_POOL_CACHE_SIZE, 0, 0, rte_socket_id());
+	if (ctl->ind_mp == NULL) {
+		LOG_ERROR("Failed to create TX indirect pool for queue %u", ctl->queue);
+		goto free_pools;
+	}
+
+	snprintf(name, sizeof(name), "TX_PAYLOAD_%u", ctl->queue);
+	ctl->payload_mp = rte_pktmbuf_pool_create(name, 1, 0, 0,
+					RTE_PKTMBUF_HEADROOM + len, rte_socket_id());
+	if (ctl->payload_mp == NULL) {
+		LOG_ERROR("Failed to create TX payload for queue %u", ctl->queue);
+		goto free_pools;
+	}
+
+	/* never freed, the indirect mbufs only take references on it. It
+	 * is as long as the longest frame, shorter ones use a part of it. */
+	ctl->payload = rte_pktmbuf_alloc(ctl->payload_mp);
+	if (ctl->payload == NULL) {
+		LOG_ERROR("Failed to allocate TX payload for queue %u", ctl->queue);
+		goto free_pools;
+	}
+	memset(rte_pktmbuf_mtod(ctl->payload, void *), 0, len);
+	ctl->payload->data_len = len;
+	ctl->payload->pkt_len = len;
+
+	LOG_INFO("TX queue %u sends split packets", ctl->queue);
+	return true;
+
+free_pools:
+	/* rte_mempool_free() ignores NULL */
+	rte_mempool_free(ctl->payload_mp);
+	rte_mempool_free(ctl->ind_mp);
+	rte_mempool_free(ctl->hdr_mp);
+	ctl->payload_mp = NULL;
+	ctl->ind_mp = NULL;
+	ctl->hdr_mp = NULL;
+	return false;
+}
+
+/* Table of header images of the flows of the queue, one cache line of
+ * hugepage memory per flow (640 MB for 10M flows over all queues), so
+ * that replay doesn't build any header. Images are built on the first
+ * use of their flow, which spreads the checksum work of large traces
+ * over the first pass instead of delaying the start. */
+static bool __alloc_trace_img(struct tx_ctl *ctl)
+{
+	size_t size = sizeof(struct pkt_seq_hdr_img) * ctl->nb_trace;
+
+	ctl->trace_img = (struct pkt_seq_hdr_img *)rte_zmalloc_socket(
+					"TX_TRACE_IMG", size, RTE_CACHE_LINE_SIZE, rte_socket_id());
+	if (!ctl->trace_img) {
+		LOG_ERROR("Failed to allocate trace header images (%lu bytes)", size);
+		return false;
+	}
+
+	LOG_INFO("TX queue %u has %lu bytes of header images for %u flows",
+					ctl->queue, size, ctl->nb_trace);
+	return true;
+}
+
+static inline uint64_t __sched_pos(uint64_t k, uint64_t weight, uint64_t nb)
+{
+	return (2 * k + 1) * nb / (2 * weight);
+}
+
+/* Weighted order of the flows of the queue: flow i takes w_i of the
+ * nb_sched = sum(w) slots, the k-th one at (k + 1/2) * nb_sched / w_i,
+ * so that the flows interleave evenly (smooth weighted round-robin).
+ * The positions are counting sorted. Weights are scaled down to keep
+ * about TX_SCHED_MAX slots. */
+static bool __build_trace_sched(struct tx_ctl *ctl)
+{
+	uint64_t total = 0, nb = 0, pos = 0;
+	uint32_t *weight = NULL, *slot = NULL;
+	double scale = 1;
+	unsigned i = 0, k = 0;
+	bool ret = false;
 
-    LOG_ERROR("No trace are found");
-    fclose(fp);
-    return false;
+	for (i = 0; i < ctl->nb_trace; i++)
+		total += ctl->trace_weight[i];
+	if (total > TX_SCHED_MAX) {
+		scale = (double)TX_SCHED_MAX / total;
+		LOG_INFO("Flow weights of TX queue %u are scaled by %f",
+						ctl->queue, scale);
+	}
+
+	weight = (uint32_t *)malloc(sizeof(uint32_t) * ctl->nb_trace);
+	if (!weight)
+		goto fail;
+	for (i = 0; i < ctl->nb_trace; i++) {
+		weight[i] = ctl->trace_weight[i] * scale + 0.5;
+		if (weight[i] == 0)
+			weight[i] = 1;
+		nb += weight[i];
+	}
+
+	slot = (uint32_t *)calloc(nb + 1, sizeof(uint32_t));
+	ctl->trace_sched = (uint32_t *)rte_malloc_socket("TX_TRACE_SCHED",
+					sizeof(uint32_t) * nb, RTE_CACHE_LINE_SIZE, rte_socket_id());
+	if (!slot || !ctl->trace_sched)
+		goto fail;
+
+	for (i = 0; i < ctl->nb_trace; i++) {
+		for (k = 0; k < weight[i]; k++)
+			slot[__sched_pos(k, weight[i], nb) + 1]++;
+	}
+	for (pos = 1; pos <= nb; pos++)
+		slot[pos] += slot[pos - 1];
+	for (i = 0; i < ctl->nb_trace; i++) {
+		for (k = 0; k < weight[i]; k++)
+			ctl->trace_sched[slot[__sched_pos(k, weight[i], nb)]++] = i;
+	}
+
+	ctl->nb_sched = nb;
+	LOG_INFO("TX queue %u replays %u flows in a schedule of %u",
+					ctl->queue, ctl->nb_trace, ctl->nb_sched);
+	ret = true;
+
+fail:
+	if (!ret)
+		LOG_ERROR("Failed to build the flow schedule of TX queue %u",
+						ctl->queue);
+	free(slot);
+	free(weight);
+	return ret;
+}
+
+/* Load of a flow: its weight, in packets or in bytes on the wire */
+static inline double __flow_cost(unsigned flow, bool is_pps)
+{
+	double weight = tx_conf.trace_weight ? tx_conf.trace_weight[flow] : 1;
+
+	if (is_pps)
+		return weight;
+	return weight * (tx_conf.trace[flow].pkt_len + PKT_SEQ_WIRE_OVERHEAD);
+}
+
+/* Check the frame sizes of the flows, and cut the trace into one slice
+ * per TX queue. Queues get the same share of the TX rate, so the slices
+ * carry about the same load, counted as the rate is. */
+static bool __split_trace(unsigned nb_queue)
+{
+	const struct pkt_seq_info *flow = NULL;
+	bool is_pps = (tx_conf.tx_rate.unit == RATE_UNIT_PPS);
+	unsigned nb = tx_conf.nb_trace, min_len = 0, i = 0, q = 0;
+	double total = 0, sum = 0;
+
+	tx_conf.max_pkt_len = 0;
+	for (i = 0; i < nb; i++) {
+		flow = &tx_conf.trace[i];
+		min_len = pkt_seq_hdr_len(flow);
+		if (tx_conf.is_split)
+			min_len += sizeof(struct pkt_latency);
+		if (tx_conf.is_latency)
+			min_len = RTE_MAX(min_len, (unsigned)PKT_SEQ_LATENCY_MINSIZE);
+		if (flow->pkt_len < min_len || flow->pkt_len > TX_FRAME_MAX) {
+			LOG_ERROR("Frame size %u of flow %u is not in [%u, %u]",
+							flow->pkt_len, i, min_len, TX_FRAME_MAX);
+			return false;
+		}
+		tx_conf.max_pkt_len = RTE_MAX(tx_conf.max_pkt_len, flow->pkt_len);
+		total += __flow_cost(i, is_pps);
+	}
+
+	/* one flow per queue otherwise, see __tx_queue_init() */
+	if (nb < nb_queue)
+		return true;
+
+	/* at least one flow per queue */
+	tx_trace_first[0] = 0;
+	for (q = 1, i = 0; q < nb_queue; q++) {
+		while (i < nb - (nb_queue - q) && (i <= tx_trace_first[q - 1]
+						|| sum < total * q / nb_queue)) {
+			sum += __flow_cost(i, is_pps);
+			i++;
+		}
+		tx_trace_first[q] = i;
+	}
+	tx_trace_first[nb_queue] = nb;
+	return true;
 }
 
-static bool __tx_init(unsigned tx_type, struct rte_mempool *mp,
+static inline uint32_t __pcap_u32(uint32_t val, bool is_swap)
+{
+	return is_swap ? __builtin_bswap32(val) : val;
+}
+
+static bool __read_pcap_rec(FILE *fp, struct pcap_rec_hdr *rec, bool is_swap)
+{
+	if (fread(rec, sizeof(struct pcap_rec_hdr), 1, fp) != 1)
+		return false;
+	rec->ts_sec = __pcap_u32(rec->ts_sec, is_swap);
+	rec->ts_frac = __pcap_u32(rec->ts_frac, is_swap);
+	rec->caplen = __pcap_u32(rec->caplen, is_swap);
+	rec->len = __pcap_u32(rec->len, is_swap);
+	return true;
+}
+
+/* Load the whole capture into mbufs of a dedicated pool, nothing is
+ * read from the file during the run. The file is read twice, to size
+ * the pool first. */
+/* Empty records and frames longer than the MTU are not replayed */
+static inline bool __pcap_rec_is_skipped(const struct pcap_rec_hdr *rec)
+{
+	return rec->caplen == 0 || rec->caplen > TX_FRAME_MAX;
+}
+
+static bool __load_pcap(const char *filename)
+{
+	FILE *fp = fopen(filename, "r");
+	struct pcap_file_hdr hdr;
+	struct pcap_rec_hdr rec;
+	struct rte_mempool *mp = NULL;
+	struct tx_pcap_pkt *pkt = NULL;
+	struct rte_mbuf *m = NULL;
+	uint64_t ns = 0, first_ns = 0, frac_ns = 1;
+	unsigned nb = 0, nb_skip = 0, nb_trunc = 0, max_len = 0, i = 0;
+	double cycle_per_ns = 0;
+	bool is_swap = false;
+
+	if (!fp) {
+		LOG_ERROR("Failed to open pcap file %s", filename);
+		return false;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+		hdr.magic = 0;
+	switch (hdr.magic) {
+		case PCAP_MAGIC_US:
+			frac_ns = 1000;
+			break;
+		case PCAP_MAGIC_NS:
+			break;
+		case __builtin_bswap32(PCAP_MAGIC_US):
+			frac_ns = 1000;
+			is_swap = true;
+			break;
+		case __builtin_bswap32(PCAP_MAGIC_NS):
+			is_swap = true;
+			break;
+		default:
+			LOG_ERROR("%s is not a pcap file", filename);
+			goto close_file;
+	}
+	if (__pcap_u32(hdr.linktype, is_swap) != PCAP_LINK_EN10MB) {
+		LOG_ERROR("Only Ethernet captures can be replayed");
+		goto close_file;
+	}
+
+	while (__read_pcap_rec(fp, &rec, is_swap)) {
+		if (__pcap_rec_is_skipped(&rec)) {
+			nb_skip++;
+		} else {
+			nb++;
+			max_len = RTE_MAX(max_len, rec.caplen);
+		}
+		if (fseek(fp, rec.caplen, SEEK_CUR) != 0)
+			break;
+	}
+	if (nb == 0) {
+		LOG_ERROR("No packet to replay in %s", filename);
+		goto close_file;
+	}
+
+	mp = rte_pktmbuf_pool_create("TX_PCAP_POOL", nb, 0, 0,
+					RTE_PKTMBUF_HEADROOM + max_len, rte_socket_id());
+	tx_conf.pcap = (struct tx_pcap_pkt *)rte_zmalloc("TX_PCAP",
+					sizeof(struct tx_pcap_pkt) * nb, RTE_CACHE_LINE_SIZE);
+	if (!mp || !tx_conf.pcap) {
+		LOG_ERROR("Failed to allocate %u pcap packets", nb);
+		goto free_pcap;
+	}
+
+	cycle_per_ns = (double)rte_get_tsc_hz() / 1000000000
+					/ (tx_conf.pcap_speed > 0 ? tx_conf.pcap_speed : 1);
+	fseek(fp, sizeof(hdr), SEEK_SET);
+	while (i < nb && __read_pcap_rec(fp, &rec, is_swap)) {
+		if (__pcap_rec_is_skipped(&rec)) {
+			fseek(fp, rec.caplen, SEEK_CUR);
+			continue;
+		}
+
+		m = rte_pktmbuf_alloc(mp);
+		if (!m || fread(rte_pktmbuf_append(m, rec.caplen), rec.caplen,
+								1, fp) != 1) {
+			LOG_ERROR("Failed to read pcap packet %u", i);
+			goto free_pcap;
+		}
+		if (rec.caplen < rec.len)
+			nb_trunc++;
+
+		ns = rec.ts_sec * 1000000000ULL + rec.ts_frac * frac_ns;
+		if (i == 0)
+			first_ns = ns;
+
+		pkt = &tx_conf.pcap[i++];
+		pkt->m = m;
+		pkt->cycle = (ns > first_ns) ? (ns - first_ns) * cycle_per_ns : 0;
+		if (tx_conf.is_latency) {
+			pkt->is_lat_ok = pkt_seq_raw_latency_ok(m);
+			/* captured packets may carry the marker by chance */
+			pkt_seq_raw_set_latency_mark(m, false);
+		}
+	}
+	if (i == 0) {
+		LOG_ERROR("Failed to read pcap packets");
+		goto free_pcap;
+	}
+	fclose(fp);
+
+	tx_conf.nb_pcap = i;
+	/* the loop ends one mean gap after its last packet */
+	tx_conf.pcap_loop_len = pkt->cycle;
+	if (i > 1)
+		tx_conf.pcap_loop_len += pkt->cycle / (i - 1);
+
+	LOG_INFO("Load %u pcap packets, %u empty or too long skipped, "
+				"%u truncated by the snaplen", i, nb_skip, nb_trunc);
+	return true;
+
+free_pcap:
+	/* the mbufs go with their pool */
+	rte_mempool_free(mp);
+	rte_free(tx_conf.pcap);
+	tx_conf.pcap = NULL;
+close_file:
+	fclose(fp);
+	return false;
+}
+
+bool tx_init(unsigned nb_queue, struct rte_mempool *mp, unsigned tx_type,
 				struct pkt_seq_info *seq, const char *filename)
 {
-	if (tx_type >= TX_TYPE_MAX) {
-		LOG_ERROR("Wrong TX type %u", tx_type);
+	struct trace trace;
+
+	if (nb_queue == 0 || nb_queue > WORKER_QUEUE_MAX) {
+		LOG_ERROR("Wrong number of TX queues %u", nb_queue);
 		return false;
 	}
-	tx_ctl.tx_type = tx_type;
 
-	if (tx_ctl.tx_rate.rate_bps == 0)
-		tx_set_rate(TX_RATE_DEF);
+	if (mp == NULL || tx_type >= TX_TYPE_MAX) {
+		LOG_ERROR("Invalid parameters, tx type %u", tx_type);
+		return false;
+	}
+	tx_conf.tx_type = tx_type;
+
+	/* searches go up to the TX rate, the line rate by default, and
+	 * sweeps up to their own upper bound */
+	tx_conf.is_trial = trial_is_enabled();
+	if (!trial_get_sweep_rate(&tx_conf.tx_rate) && tx_conf.tx_rate.rate == 0)
+		tx_set_rate(tx_conf.is_trial ? TX_RATE_TRIAL_DEF : TX_RATE_DEF);
+
+	if (tx_conf.is_trial && (tx_conf.is_prebuilt || tx_conf.is_split
+					|| tx_conf.tx_count || tx_type == TX_TYPE_5TUPLE_TRACE
+					|| tx_type == TX_TYPE_PCAP)) {
+		LOG_ERROR("Trials change the packet size, they don't work with "
+					"prebuilt, split, trace or pcap packets, nor a packet "
+					"count");
+		return false;
+	}
 
 	__set_tx_pkt_info(seq);
+	tx_conf.max_pkt_len = tx_conf.pkt_info.pkt_len;
 
 	if (tx_type == TX_TYPE_RANDOM)
 		rte_srand(rte_get_tsc_cycles());
 
-	tx_ctl.tx_mp = mp;
+	tx_conf.tx_mp = mp;
+	tx_nb_queue = nb_queue;
 
-	if (tx_type == TX_TYPE_SINGLE || tx_type == TX_TYPE_RANDOM) {
-//		/* Set default packets */
-//		param.info = &tx_ctl.pkt_info;
-//		param.type = tx_type;
-//		rte_mempool_obj_iter(tx_ctl.tx_mp, __pkt_setup, &param);
+	if (tx_conf.is_split && tx_conf.is_prebuilt) {
+		LOG_INFO("Split packets are used instead of prebuilt ones");
+		tx_conf.is_prebuilt = false;
+	}
+	rte_atomic32_set(&tx_running, nb_queue);
 
+	LOG_INFO("mode %u, file %s, %u TX queues", tx_type, filename, nb_queue);
+
+	if (tx_type == TX_TYPE_SINGLE || tx_type == TX_TYPE_RANDOM) {
+		/* Packets are set up in __tx_queue_init() */
 	} else if (tx_type == TX_TYPE_5TUPLE_TRACE) {
 		LOG_INFO("Load trace file %s", filename);
-        return __load_tuple_traces(filename);
+		if (!trace_load(filename, tx_conf.pkt_info.pkt_len, &trace))
+			return false;
+		tx_conf.trace = trace.flows;
+		tx_conf.trace_weight = trace.weights;
+		tx_conf.nb_trace = trace.nb_flow;
+		if (!__split_trace(nb_queue))
+			return false;
+
+		/* Replay copies header images into prebuilt packets */
+		if (!tx_conf.is_split)
+			tx_conf.is_prebuilt = true;
+	} else if (tx_type == TX_TYPE_PCAP) {
+		/* captured packets are sent as they are */
+		if (tx_conf.is_prebuilt || tx_conf.is_split) {
+			LOG_INFO("Pcap packets are neither prebuilt nor split");
+			tx_conf.is_prebuilt = false;
+			tx_conf.is_split = false;
+		}
+		if (tx_conf.is_late_ts) {
+			LOG_INFO("Pcap latency samples are stamped when copied");
+			tx_conf.is_late_ts = false;
+		}
+		LOG_INFO("Load pcap file %s", tx_conf.pcap_file);
+		return __load_pcap(tx_conf.pcap_file);
 	}
 
 	return true;
 }
 
+/* Give each TX queue its share of the rate, the packet count and the
+ * flow set. The remainders go to the first queues, so that the sum over
+ * all queues is exactly what was configured. */
+static struct tx_ctl *__tx_queue_init(unsigned queue)
+{
+	struct tx_ctl *ctl = &tx_ctls[queue];
+	unsigned nb = tx_nb_queue;
+	unsigned first = 0, last = 0;
+
+	memcpy(ctl, &tx_conf, sizeof(struct tx_ctl));
+	ctl->queue = queue;
+
+	if (!rate_set_share(&ctl->tx_rate, &tx_conf.tx_rate, nb))
+		return NULL;
+
+	if (tx_conf.tx_count) {
+		ctl->tx_count = tx_conf.tx_count / nb;
+		if (queue < tx_conf.tx_count % nb)
+			ctl->tx_count++;
+		ctl->tx_ret = ctl->tx_count;
+	}
+
+	if (ctl->tx_type == TX_TYPE_5TUPLE_TRACE) {
+		if (tx_conf.nb_trace < nb) {
+			first = queue % tx_conf.nb_trace;
+			last = first + 1;
+			ctl->trace_weight = NULL;
+		} else {
+			first = tx_trace_first[queue];
+			last = tx_trace_first[queue + 1];
+			if (tx_conf.trace_weight)
+				ctl->trace_weight = &tx_conf.trace_weight[first];
+		}
+		ctl->trace = &tx_conf.trace[first];
+		ctl->nb_trace = last - first;
+		ctl->trace_iter = 0;
+		LOG_INFO("TX queue %u replays traces [%u, %u)", queue, first, last);
+		if (ctl->is_prebuilt && !__alloc_trace_img(ctl))
+			return NULL;
+		if (ctl->trace_weight && !__build_trace_sched(ctl))
+			return NULL;
+	} else if (ctl->tx_type == TX_TYPE_PCAP) {
+		/* packets are dealt to the queues in turn, so that all of them
+		 * follow the capture timing */
+		ctl->pcap_first = queue;
+		ctl->pcap_step = nb;
+		ctl->pcap_iter = queue;
+		ctl->pcap_loop = 0;
+		ctl->pcap_loop_cycle = 0;
+		if (queue >= tx_conf.nb_pcap)
+			LOG_INFO("TX queue %u has no pcap packet to replay", queue);
+	} else {
+		/* one flow per queue */
+		ctl->pkt_info.src_port += queue;
+	}
+
+	ctl->lat_id = PKT_SEQ_LATENCY_ID(queue, 0);
+	if (ctl->sample_type == TX_SAMPLE_TIME)
+		ctl->sample_every = tx_conf.sample_every * rte_get_tsc_hz() / 1000000;
+	ctl->sample_next = (ctl->sample_type == TX_SAMPLE_COUNT) ? 1 : 0;
+
+	if (ctl->is_split) {
+		if (!__tx_split_pools(ctl))
+			return NULL;
+	} else if (ctl->is_prebuilt && !__tx_prebuild_pool(ctl)) {
+		return NULL;
+	}
+	return ctl;
+}
+
 static inline void __pktmbuf_reset(struct rte_mbuf *m)
 {
 	m->next = NULL;
@@ -233,34 +1008,100 @@ __pktmbuf_alloc_bulk(struct rte_mempool *pool,
 	return 0;
 }
 
-static int __process_tx(int portid __rte_unused, struct tx_ctl *ctl)
+/* Pick up a new trial, returns false outside of its time window */
+static inline bool __tx_trial(struct tx_ctl *ctl, uint64_t cur_cycle)
+{
+	const struct trial *trial = trial_get();
+
+	if (trial->gen != ctl->trial_gen) {
+		rte_smp_rmb();
+		ctl->trial_gen = trial->gen;
+		ctl->pkt_info.pkt_len = trial->pkt_len;
+		ctl->is_latency = tx_conf.is_latency
+						&& trial->pkt_len >= PKT_SEQ_LATENCY_MINSIZE;
+		rate_set_level(&ctl->tx_rate, trial->level);
+		ctl->tx_rate.frac = 0;
+		ctl->tx_rate.next_tx_cycle = trial->start_cycle;
+		/* latency records are tagged with the trial */
+		ctl->tx_rate.step = trial->gen & RATE_PROFILE_STEP_MAX;
+		ctl->trial_stop_cycle = trial->stop_cycle;
+	}
+	return cur_cycle < ctl->trial_stop_cycle;
+}
+
+/* Bytes of the n packets of the burst from offset, the packets may be
+ * gone once sent */
+static inline unsigned __tx_bytes(const struct tx_ctl *ctl,
+				unsigned offset, unsigned n)
+{
+	unsigned i = 0, sum = 0;
+
+	for (i = offset; i < offset + n; i++)
+		sum += ctl->tx_len[i];
+	return sum;
+}
+
+static int __process_tx(int portid, struct tx_ctl *ctl)
 {
 	int ret = 0;
 	struct rte_mbuf **pkts = NULL;
 	struct rate_ctl *rate = &ctl->tx_rate;
 	unsigned int cnt = 0, i = 0;
 	unsigned int sum = 0;
-	uint64_t start_cyc = 0;
+	uint64_t start_cyc = 0, ts = 0;
 
 	start_cyc = rte_get_tsc_cycles();
+
+	/* packets left over when a trial ends are still sent */
+	if (ctl->is_trial && !__tx_trial(ctl, start_cyc) && ctl->len <= 0)
+		return 0;
+
 	if (start_cyc < rate->next_tx_cycle) {
 		return 0;
 	}
 
+	if (rate_update_step(rate, start_cyc) && ctl->queue == 0)
+		rate_log_step(rate);
+
 	if (ctl->len <= 0) {
 		cnt = ctl->tx_burst;
 
+		/* tag packets with the load step they are sent at */
+		if (ctl->is_latency)
+			ctl->lat_id = PKT_SEQ_LATENCY_SET_STEP(ctl->lat_id, rate->step);
+
 		if (ctl->tx_count && ctl->tx_burst > ctl->tx_ret)
 			cnt = ctl->tx_ret;
 
-		ret = __pktmbuf_alloc_bulk(ctl->tx_mp, ctl->mbuf_tbl, cnt);
-		if (ret == 0) {
-			pkts = ctl->mbuf_tbl;
+		if (ctl->tx_type == TX_TYPE_PCAP) {
+			/* nothing due yet, or all loops replayed */
+			cnt = __pkt_setup_pcap(ctl, cnt, start_cyc);
+			if (cnt == 0)
+				return 0;
+		} else if (ctl->is_split) {
+			ret = __pkt_setup_split(ctl, cnt, start_cyc);
+		} else {
+			ret = __pktmbuf_alloc_bulk(ctl->tx_mp, ctl->mbuf_tbl, cnt);
+			if (ret == 0) {
+				pkts = ctl->mbuf_tbl;
 
-			for (i = 0; i < cnt; i++) {
-				__pkt_setup(pkts[i], ctl->tx_type);
+				if (ctl->is_prebuilt) {
+					for (i = 0; i < cnt; i++) {
+						ctl->is_sampled[i] = __pkt_update(ctl, pkts[i],
+										start_cyc);
+						ctl->tx_len[i] = pkts[i]->pkt_len;
+					}
+				} else {
+					for (i = 0; i < cnt; i++) {
+						ctl->is_sampled[i] = __pkt_setup(ctl, pkts[i],
+										start_cyc);
+						ctl->tx_len[i] = pkts[i]->pkt_len;
+					}
+				}
 			}
+		}
 
+		if (ret == 0) {
 			ctl->len = cnt;
 			ctl->offset = 0;
 
@@ -272,25 +1113,53 @@ static int __process_tx(int portid __rte_unused, struct tx_ctl *ctl)
 	}
 
 	pkts = &ctl->mbuf_tbl[ctl->offset];
-	ret = rte_eth_tx_burst(portid, 0, pkts, ctl->len);
+
+	/* packets left over by the previous burst are stamped again */
+	if (ctl->is_latency && ctl->is_late_ts) {
+		ts = rte_get_tsc_cycles();
+		for (i = 0; i < ctl->len; i++) {
+			if (ctl->is_sampled[ctl->offset + i])
+				pkt_seq_update_timestamp(pkts[i], ts);
+		}
+	}
+
+	ret = rte_eth_tx_burst(portid, ctl->queue, pkts, ctl->len);
 
 	if (ctl->tx_count)
 		ctl->tx_ret -= ret;
 	ctl->len -= ret;
 	ctl->offset += ret;
 
-	sum = (ctl->pkt_info.pkt_len) * ret;
-	stat_update_tx(sum, ret);
-	rate_set_next_cycle(&ctl->tx_rate, start_cyc, ret);
+	sum = __tx_bytes(ctl, ctl->offset - ret, ret);
+	stat_update_tx(ctl->queue, sum, ret);
+	/* the capture timing paces the replay on its own */
+	if (!(ctl->tx_type == TX_TYPE_PCAP && ctl->pcap_speed > 0))
+		rate_set_next_cycle(&ctl->tx_rate, start_cyc, ret, sum);
 	return 0;
 }
 
-void tx_thread_run_tx(int portid,
-				struct rte_mempool *mp, unsigned tx_type,
-				struct pkt_seq_info *seq, const char *filename)
+/* The last queue to finish stops the test, a failed queue counts as
+ * finished, or count-limited and pcap runs would never end */
+static void __tx_queue_exit(bool is_error)
+{
+	if (!rte_atomic32_dec_and_test(&tx_running))
+		return;
+
+	if (is_error) {
+		LOG_ERROR("No TX queue left, stop test");
+		ctl_quit();
+	} else if (tx_conf.tx_count) {
+		LOG_INFO("TX %u packets, stop test", tx_conf.tx_count);
+		ctl_quit();
+	} else if (tx_conf.tx_type == TX_TYPE_PCAP && tx_conf.pcap_loops) {
+		LOG_INFO("Pcap replayed %u times, stop test", tx_conf.pcap_loops);
+		ctl_quit();
+	}
+}
+
+void tx_thread_run_tx(int portid, unsigned queue)
 {
-//	int ret = 0;
-//	unsigned int tx_retry = 0;
+	struct tx_ctl *ctl = NULL;
 
 	/* waiting for stat thread */
 	while (ctl_get_state(WORKER_STAT) == STATE_UNINIT && !ctl_is_stop(WORKER_TX)) {}
@@ -299,41 +1168,51 @@ void tx_thread_run_tx(int portid,
 					|| ctl_get_state(WORKER_STAT) == STATE_ERROR)
 		return;
 
-	if (portid < 0 || mp == NULL || tx_type >= TX_TYPE_MAX) {
-		LOG_ERROR("Invalid parameters, portid %d, tx type %u",
-						portid, tx_type);
-		ctl_set_state(WORKER_TX, STATE_ERROR);
+	if (portid < 0 || queue >= tx_nb_queue) {
+		LOG_ERROR("Invalid parameters, portid %d, queue %u",
+						portid, queue);
+		ctl_set_state(WORKER_TX, queue, STATE_ERROR);
 		return;
 	}
 
-	LOG_INFO("mode %u, file %s", tx_type, filename);
-
-	if (!__tx_init(tx_type, mp, seq, filename)) {
-		LOG_ERROR("Failed to initialize TX");
-		ctl_set_state(WORKER_TX, STATE_ERROR);
+	ctl = __tx_queue_init(queue);
+	if (ctl == NULL) {
+		LOG_ERROR("Failed to initialize TX queue %u", queue);
+		__tx_queue_exit(true);
+		ctl_set_state(WORKER_TX, queue, STATE_ERROR);
 		return;
 	}
 
-	LOG_INFO("tx running on lcore %u", rte_lcore_id());
-
-//	tx_seq_iter = 0;
+	LOG_INFO("tx queue %u running on lcore %u", queue, rte_lcore_id());
+	rate_start_profile(rte_get_tsc_cycles());
 
-	ctl_set_state(WORKER_TX, STATE_INITED);
+	ctl_set_state(WORKER_TX, queue, STATE_INITED);
 
-	while (!ctl_is_stop(WORKER_TX)) {
+	/* nothing left for this queue when the count is smaller than
+	 * the number of queues */
+	while (!(tx_conf.tx_count && ctl->tx_count == 0)
+					&& !ctl_is_stop(WORKER_TX)) {
 		/* TX */
-		if (__process_tx(portid, &tx_ctl) < 0) {
+		if (__process_tx(portid, ctl) < 0) {
 			LOG_ERROR("TX error!");
 			break;
 		}
 
-		if (tx_ctl.tx_count && tx_ctl.tx_ret == 0) {
-			LOG_INFO("TX %u packets, stop test", tx_ctl.tx_count);
-			ctl_quit();
+		if (ctl->tx_count && ctl->tx_ret == 0) {
+			LOG_INFO("TX queue %u sent %u packets", queue, ctl->tx_count);
+			break;
+		}
+
+		if (ctl->tx_type == TX_TYPE_PCAP && ctl->len == 0
+						&& __pcap_is_done(ctl)) {
+			LOG_INFO("TX queue %u replayed the capture %u times",
+							queue, ctl->pcap_loop);
 			break;
 		}
 	}
 
+	__tx_queue_exit(false);
+
 	LOG_INFO("TX thread quit.");
-	ctl_set_state(WORKER_TX, STATE_STOPPED);
+	ctl_set_state(WORKER_TX, queue, STATE_STOPPED);
 }
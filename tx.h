@@ -14,19 +14,64 @@ enum {
 	TX_TYPE_SINGLE = 0,
 	TX_TYPE_RANDOM,
 	TX_TYPE_5TUPLE_TRACE,
-//	TX_TYPE_PCAP,
+	TX_TYPE_PCAP,
 	TX_TYPE_MAX,
 };
 
 
 
+/* Latency sampling, see tx_set_sampling() */
+enum {
+	TX_SAMPLE_ALL = 0,
+	TX_SAMPLE_COUNT,
+	TX_SAMPLE_TIME,
+};
+
 #define MBUF_SIZE (RTE_MBUF_DEFAULT_BUF_SIZE + DEFAULT_PRIV_SIZE)
-#define TUPLE_TRACE_MAX 65535
+
+/* Dedicated per-queue pool of prebuilt packets */
+#define TX_POOL_SIZE 4095
+#define TX_POOL_CACHE_SIZE 250
+
+/* Header/payload split TX: per-queue pools of small header and tail
+ * segments, and of indirect mbufs of the shared payload */
+#define TX_HDR_POOL_SIZE (2 * TX_POOL_SIZE + 1)
+#define TX_HDR_DATA_ROOM (RTE_PKTMBUF_HEADROOM + 128)
+
+/* Longest frame sent, without FCS */
+#define TX_FRAME_MAX (RTE_ETHER_MAX_LEN - RTE_ETHER_CRC_LEN)
+
+/* Weighted traces are replayed in a schedule of flow indexes, of up to
+ * about TX_SCHED_MAX entries per TX queue */
+#define TX_SCHED_MAX (1 << 22)
+
+/* Pcap replay: the capture is loaded into one mbuf per packet, which
+ * are sent by reference (refcnt) and never go back to their pool.
+ * Latency samples are copies. Empty frames and the ones longer than the
+ * MTU are skipped. */
+
+struct tx_pcap_pkt {
+	struct rte_mbuf *m;
+	/* TX time from the start of the capture, scaled by the speed */
+	uint64_t cycle;
+	/* the latency fields fit in, see pkt_seq_raw_latency_ok() */
+	bool is_lat_ok;
+};
 
 struct tx_ctl {
 	unsigned int tx_type;
+	unsigned int queue;
 
 	struct rte_mempool *tx_mp;
+	/* packets in tx_mp are built once and only updated on TX */
+	bool is_prebuilt;
+	/* packets are chained from a header mbuf of hdr_mp, an indirect
+	 * mbuf of ind_mp attached to payload, and a tail mbuf of hdr_mp */
+	bool is_split;
+	struct rte_mempool *hdr_mp;
+	struct rte_mempool *ind_mp;
+	struct rte_mempool *payload_mp;
+	struct rte_mbuf *payload;
 
 	struct pkt_seq_info pkt_info;
 
@@ -39,25 +84,80 @@ struct tx_ctl {
 	/* fot 5-tuple trace */
 	unsigned nb_trace;
 	unsigned trace_iter;
-	struct pkt_seq_info trace[TUPLE_TRACE_MAX];
+	struct pkt_seq_info *trace;
+	/* one header image per flow, built on first use */
+	struct pkt_seq_hdr_img *trace_img;
+	/* per-flow weights, NULL if all flows weigh the same, and the
+	 * weighted order of the flows, trace_iter going through it */
+	uint32_t *trace_weight;
+	uint32_t *trace_sched;
+	unsigned nb_sched;
+	/* longest frame of the flows, for the buffers they share */
+	uint16_t max_pkt_len;
+
+	/* for pcap replay: packets first, first + step, ... of the capture,
+	 * at the TX rate, or at their capture times scaled by pcap_speed
+	 * if not 0. Replayed pcap_loops times, 0 until stopped. */
+	char pcap_file[FILEPATH_MAX];
+	struct tx_pcap_pkt *pcap;
+	unsigned nb_pcap;
+	unsigned pcap_first;
+	unsigned pcap_step;
+	unsigned pcap_iter;
+	unsigned pcap_loops;
+	unsigned pcap_loop;
+	double pcap_speed;
+	/* cycles of one loop, and start of the current one */
+	uint64_t pcap_loop_len;
+	uint64_t pcap_loop_cycle;
 
 	/* for latency measurement */
 	bool is_latency;
+	/* stamp TX time right before rte_eth_tx_burst() */
+	bool is_late_ts;
+	/* only sampled packets carry the latency fields: one in
+	 * sample_every packets, or one every sample_every cycles (usec
+	 * in tx_conf) */
+	unsigned sample_type;
+	uint64_t sample_every;
+	uint64_t sample_next;
+
+	/* rate and packet size are set by trials, see trial.h */
+	bool is_trial;
+	uint32_t trial_gen;
+	uint64_t trial_stop_cycle;
+	uint64_t lat_id;
 	char latency_file[FILEPATH_MAX];
 
 	unsigned int len;
 	unsigned int offset;
 	struct rte_mbuf *mbuf_tbl[TX_BURST];
-};
+	bool is_sampled[TX_BURST];
+	/* lengths of the packets of mbuf_tbl, for the pacer */
+	uint16_t tx_len[TX_BURST];
+} __rte_cache_aligned;
 
-void tx_thread_run_tx(int portid,
-				struct rte_mempool *mp, unsigned tx_type,
+bool tx_init(unsigned nb_queue, struct rte_mempool *mp, unsigned tx_type,
 				struct pkt_seq_info *seq, const char *filename);
 
-void tx_set_rate(const char *rate_str);
+void tx_thread_run_tx(int portid, unsigned queue);
+
+bool tx_set_rate(const char *rate_str);
+
+const struct rate_ctl *tx_get_rate(void);
 void tx_set_count(int cnt);
 void tx_set_burst(int burst);
 
 void tx_enable_latency(void);
 
+void tx_enable_late_timestamp(void);
+
+bool tx_set_sampling(const char *sample);
+
+void tx_enable_prebuilt(void);
+
+void tx_enable_split(void);
+
+bool tx_set_pcap(const char *spec);
+
 #endif /* _PKTGEN_TX_H_ */
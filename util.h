@@ -106,4 +106,20 @@ static inline bool str_to_int(
 	return true;
 }
 
+static inline bool str_to_double(const char *s, double *d)
+{
+	double val = 0;
+	char *tail = NULL;
+
+	errno = 0;
+	val = strtod(s, &tail);
+	if (errno == ERANGE || tail == s || *tail != '\0') {
+		*d = 0;
+		return false;
+	}
+
+	*d = val;
+	return true;
+}
+
 #endif /* _PKTGEN_UTIL_H_ */
@@ -0,0 +1,235 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* O_DIRECT, fallocate() */
+#endif
+
+#include "util.h"
+#include "writer.h"
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <rte_common.h>
+
+/* No libaio, the syscalls are simple enough */
+static inline int __io_setup(unsigned nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int __io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int __io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static inline int __io_getevents(aio_context_t ctx, long min_nr, long nr,
+				struct io_event *events)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, NULL);
+}
+
+static void __free_bufs(struct writer *w)
+{
+	unsigned i = 0;
+
+	for (i = 0; i < WRITER_NB_BUF; i++) {
+		free(w->buf[i].data);
+		w->buf[i].data = NULL;
+	}
+}
+
+bool writer_open(struct writer *w, const char *path)
+{
+	unsigned i = 0;
+
+	memset(w, 0, sizeof(struct writer));
+
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	w->is_direct = (w->fd >= 0);
+	if (w->fd < 0 && errno == EINVAL) {
+		LOG_INFO("O_DIRECT is not supported for %s, use buffered writes",
+						path);
+		w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (w->fd < 0) {
+		LOG_ERROR("Failed to open %s, %s", path, strerror(errno));
+		return false;
+	}
+
+	for (i = 0; i < WRITER_NB_BUF; i++) {
+		if (posix_memalign((void **)&w->buf[i].data, WRITER_ALIGN,
+								WRITER_BUF_SIZE) != 0) {
+			LOG_ERROR("Failed to allocate writer buffers");
+			__free_bufs(w);
+			close(w->fd);
+			w->fd = -1;
+			return false;
+		}
+	}
+
+	if (__io_setup(WRITER_NB_BUF, &w->aio) < 0) {
+		LOG_INFO("AIO is not available (%s), use synchronous writes",
+						strerror(errno));
+		w->aio = 0;
+	}
+	return true;
+}
+
+/* Reserve the blocks of the file beforehand, so that writes don't
+ * wait for block allocation */
+bool writer_prealloc(struct writer *w, uint64_t bytes)
+{
+	if (fallocate(w->fd, 0, 0, bytes) < 0) {
+		LOG_ERROR("Failed to preallocate %lu bytes, %s", bytes,
+						strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static void __complete(struct writer *w, struct writer_buf *buf, long res)
+{
+	if (res != (long)buf->iocb.aio_nbytes) {
+		LOG_ERROR("Failed to write %llu bytes at %lld, ret %ld",
+						buf->iocb.aio_nbytes, buf->iocb.aio_offset, res);
+		w->nb_error++;
+	}
+	buf->len = 0;
+	buf->is_busy = false;
+	w->nb_inflight--;
+}
+
+/* The AIO context is unusable: it is torn down, which waits for or
+ * cancels the writes in flight, and their buffers, still intact, are
+ * written again synchronously. Later writes are synchronous. */
+static void __fall_back_sync(struct writer *w)
+{
+	struct writer_buf *buf = NULL;
+	ssize_t ret = 0;
+	unsigned i = 0;
+
+	LOG_ERROR("Failed to reap writes (%s), use synchronous writes",
+					strerror(errno));
+	__io_destroy(w->aio);
+	w->aio = 0;
+
+	for (i = 0; i < WRITER_NB_BUF; i++) {
+		buf = &w->buf[i];
+		if (!buf->is_busy)
+			continue;
+		ret = pwrite(w->fd, buf->data, buf->iocb.aio_nbytes,
+						buf->iocb.aio_offset);
+		__complete(w, buf, ret);
+	}
+}
+
+/* Reap the completed writes, waiting for at least min_nr of them */
+static void __reap(struct writer *w, long min_nr)
+{
+	struct io_event events[WRITER_NB_BUF];
+	int nb = 0, i = 0;
+
+	nb = __io_getevents(w->aio, min_nr, WRITER_NB_BUF, events);
+	if (nb < 0) {
+		if (errno != EINTR)
+			__fall_back_sync(w);
+		return;
+	}
+	for (i = 0; i < nb; i++)
+		__complete(w, (struct writer_buf *)(uintptr_t)events[i].data,
+						events[i].res);
+}
+
+static void __submit(struct writer *w, struct writer_buf *buf, size_t nbytes)
+{
+	struct iocb *iocb = &buf->iocb;
+	ssize_t ret = 0;
+
+	memset(iocb, 0, sizeof(struct iocb));
+	iocb->aio_lio_opcode = IOCB_CMD_PWRITE;
+	iocb->aio_fildes = w->fd;
+	iocb->aio_buf = (uintptr_t)buf->data;
+	iocb->aio_nbytes = nbytes;
+	iocb->aio_offset = w->offset;
+	iocb->aio_data = (uintptr_t)buf;
+	w->offset += nbytes;
+	buf->is_busy = true;
+	w->nb_inflight++;
+
+	if (w->aio != 0 && __io_submit(w->aio, 1, &iocb) == 1)
+		return;
+
+	ret = pwrite(w->fd, buf->data, nbytes, iocb->aio_offset);
+	__complete(w, buf, ret);
+}
+
+/* Copy len bytes into the buffers, full buffers are written out */
+void writer_write(struct writer *w, const void *data, size_t len)
+{
+	struct writer_buf *buf = NULL;
+	size_t n = 0;
+
+	w->size += len;
+	while (len > 0) {
+		buf = &w->buf[w->cur];
+		if (buf->is_busy)
+			w->nb_wait++;
+		while (buf->is_busy)
+			__reap(w, 1);
+
+		n = RTE_MIN(len, WRITER_BUF_SIZE - buf->len);
+		memcpy(buf->data + buf->len, data, n);
+		buf->len += n;
+		data = (const uint8_t *)data + n;
+		len -= n;
+
+		if (buf->len == WRITER_BUF_SIZE) {
+			__submit(w, buf, WRITER_BUF_SIZE);
+			w->cur = (w->cur + 1) % WRITER_NB_BUF;
+		}
+	}
+}
+
+/* Reap the completed writes without waiting */
+void writer_poll(struct writer *w)
+{
+	if (w->nb_inflight > 0 && w->aio != 0)
+		__reap(w, 0);
+}
+
+/* Write the last partial buffer, wait for all writes and trim the file
+ * to the bytes written, O_DIRECT writes being padded to WRITER_ALIGN */
+void writer_close(struct writer *w)
+{
+	struct writer_buf *buf = &w->buf[w->cur];
+	size_t nbytes = 0;
+
+	if (w->fd < 0)
+		return;
+
+	if (buf->len > 0 && !buf->is_busy) {
+		nbytes = buf->len;
+		if (w->is_direct) {
+			nbytes = RTE_ALIGN_CEIL(buf->len, WRITER_ALIGN);
+			memset(buf->data + buf->len, 0, nbytes - buf->len);
+		}
+		__submit(w, buf, nbytes);
+	}
+	while (w->nb_inflight > 0)
+		__reap(w, w->nb_inflight);
+
+	if (ftruncate(w->fd, w->size) < 0)
+		LOG_ERROR("Failed to trim output to %lu bytes", w->size);
+	if (w->nb_wait || w->nb_error)
+		LOG_INFO("Writer waited for a free buffer %lu times, "
+					"%lu writes failed", w->nb_wait, w->nb_error);
+
+	if (w->aio != 0)
+		__io_destroy(w->aio);
+	close(w->fd);
+	w->fd = -1;
+	__free_bufs(w);
+}
@@ -0,0 +1,52 @@
+#ifndef _PKTGEN_WRITER_H_
+#define _PKTGEN_WRITER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <linux/aio_abi.h>
+
+/* Output is copied into page-aligned buffers and written WRITER_BUF_SIZE
+ * bytes at a time with O_DIRECT, through Linux AIO with up to
+ * WRITER_NB_BUF writes in flight. The writer only blocks when all the
+ * buffers are in flight. Without O_DIRECT or AIO support, or once AIO
+ * fails, it falls back to buffered or synchronous writes. */
+#define WRITER_ALIGN 4096
+#define WRITER_BUF_SIZE (1 << 20)
+#define WRITER_NB_BUF 8
+
+struct writer_buf {
+	uint8_t *data;
+	size_t len;
+	bool is_busy;
+	struct iocb iocb;
+};
+
+struct writer {
+	int fd;
+	bool is_direct;
+	/* 0 if writes are synchronous */
+	aio_context_t aio;
+	/* bytes handed to the writer and file offset of the next write */
+	uint64_t size;
+	uint64_t offset;
+	unsigned cur;
+	unsigned nb_inflight;
+	/* times all buffers were in flight, and failed writes */
+	uint64_t nb_wait;
+	uint64_t nb_error;
+	struct writer_buf buf[WRITER_NB_BUF];
+};
+
+bool writer_open(struct writer *w, const char *path);
+
+bool writer_prealloc(struct writer *w, uint64_t bytes);
+
+void writer_write(struct writer *w, const void *data, size_t len);
+
+void writer_poll(struct writer *w);
+
+void writer_close(struct writer *w);
+
+#endif /* _PKTGEN_WRITER_H_ */